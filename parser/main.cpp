@@ -1,14 +1,40 @@
 #include <iostream>
-#include <ctype.h>
 #include <string>
+#include <string_view>
+#include <memory_resource>
+#include <optional>
+#include <algorithm>
+#include <cstdint>
 #include <cassert>
+#include <coroutine>
+#include <ranges>
 #include <vector>
+#include <list>
+#include <unordered_map>
 #include <utility>
 #include <memory>
-#include <sstream>
-#include <vector>
+#include <functional>
+#include <cerrno>
+#include <unistd.h>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <new>
+#include <filesystem>
+#include <fstream>
+#include <mutex>
+#include <thread>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
 
-// TODO: Add more token types as needed, > , ``, nested lists
+// TODO: Add more token types as needed
 
 /********************
 *      Types        *
@@ -26,8 +52,406 @@ typedef enum Type {
     LINK,           // [text](url)
     IMAGE,          // ![alt](url)
     LIST,           // - item
+    BOLD_OPEN,      // ** around emphasis that nests more emphasis
+    BOLD_CLOSE,
+    ITALIC_OPEN,    // * likewise
+    ITALIC_CLOSE,
+    CODE_BLOCK,     // ```info\ncode\n```
+    CODE,           // `code`
+    TOKEN_TYPE_COUNT
 } TokenType;
 
+/********************
+*      Metrics      *
+*********************/
+
+// Build with -DNOTEDOWN_METRICS=1 to collect ParseStats. Otherwise every update
+// sits behind `if constexpr (metrics_enabled)` and compiles away.
+#ifndef NOTEDOWN_METRICS
+#define NOTEDOWN_METRICS 0
+#endif
+constexpr bool metrics_enabled = NOTEDOWN_METRICS;
+
+struct ParseStats {
+    uint64_t parses = 0;
+    uint64_t bytes_in = 0;
+    uint64_t bytes_out = 0;
+    uint64_t tokens[TOKEN_TYPE_COUNT] = {};    // rendered, so memoized blocks and cache hits add none
+    uint64_t parse_ns = 0;
+    uint64_t lex_ns = 0;
+    uint64_t render_ns = 0;     // includes escape_ns
+    uint64_t escape_ns = 0;
+    uint64_t peak_tokens = 0;   // largest token vector; fused and memoized parses keep none
+
+    void merge(const ParseStats& other) {
+        parses += other.parses;
+        bytes_in += other.bytes_in;
+        bytes_out += other.bytes_out;
+        for (size_t i = 0; i < TOKEN_TYPE_COUNT; i++) {
+            tokens[i] += other.tokens[i];
+        }
+        parse_ns += other.parse_ns;
+        lex_ns += other.lex_ns;
+        render_ns += other.render_ns;
+        escape_ns += other.escape_ns;
+        peak_tokens = std::max(peak_tokens, other.peak_tokens);
+    }
+};
+
+inline uint64_t metrics_clock() {
+    if constexpr (metrics_enabled) {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    } else {
+        return 0;
+    }
+}
+
+// Adds the time since `since` to `total` and returns the current time, so
+// alternating phases can share one clock read per switch
+inline uint64_t metrics_lap(uint64_t& total, uint64_t since) {
+    if constexpr (metrics_enabled) {
+        uint64_t now = metrics_clock();
+        total += now - since;
+        return now;
+    } else {
+        return 0;
+    }
+}
+
+/********************
+*       Arena       *
+*********************/
+
+// Monotonic allocator for storage that lives exactly as long as one document.
+// Allocating is a pointer bump, deallocating is a no-op, and reset() rewinds to
+// the first block in O(1) while keeping every block for the next document. It is
+// a std::pmr::memory_resource so pmr containers can draw from it too.
+class Arena : public std::pmr::memory_resource {
+private:
+    struct Block {
+        std::unique_ptr<char[]> data;
+        size_t size;
+    };
+
+    std::vector<Block> blocks;
+    size_t current = 0;     // block being filled
+    size_t used = 0;        // bytes taken from blocks[current]
+    size_t next_block_size;
+
+    void* do_allocate(size_t bytes, size_t alignment) override {
+        while (current < blocks.size()) {
+            uintptr_t base = reinterpret_cast<uintptr_t>(blocks[current].data.get());
+            uintptr_t aligned = (base + used + alignment - 1) & ~(uintptr_t(alignment) - 1);
+            size_t offset = aligned - base;
+            if (offset + bytes <= blocks[current].size) {
+                used = offset + bytes;
+                return blocks[current].data.get() + offset;
+            }
+            if (current + 1 == blocks.size()) {
+                break;
+            }
+            current++;
+            used = 0;
+        }
+
+        size_t size = std::max(next_block_size, bytes + alignment);
+        next_block_size *= 2;
+        blocks.push_back({std::unique_ptr<char[]>(new char[size]), size});
+        current = blocks.size() - 1;
+        used = 0;
+        return do_allocate(bytes, alignment);
+    }
+
+    void do_deallocate(void*, size_t, size_t) override {}
+
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override {
+        return this == &other;
+    }
+
+public:
+    explicit Arena(size_t block_size = 64 * 1024) : next_block_size(block_size) {}
+
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+
+    // Invalidates everything allocated since the last reset
+    void reset() {
+        current = 0;
+        used = 0;
+    }
+
+    std::string_view copy(std::string_view text) {
+        char* data = static_cast<char*>(allocate(text.size(), 1));
+        std::copy(text.begin(), text.end(), data);
+        return std::string_view(data, text.size());
+    }
+};
+
+/********************
+*     Scanning      *
+*********************/
+
+// What a byte means to the lexer. get_next_token dispatches on the class of the
+// byte a token starts with, and any byte that is not CC_PLAIN ends a text run.
+enum CharClass : uint8_t {
+    CC_PLAIN,
+    CC_HEADING,     // #
+    CC_EMPHASIS,    // *
+    CC_LINK,        // [
+    CC_IMAGE,       // !
+    CC_LIST,        // -
+    CC_CODE,        // `
+    CC_NEWLINE,     // \n
+    CC_END,         // NUL
+};
+
+// Whitespace as the C locale's isspace() sees it, kept in the table's top bit
+constexpr uint8_t CHAR_SPACE = 0x80;
+constexpr uint8_t CHAR_CLASS_MASK = 0x7f;
+
+// TODO: add more characters as needed
+// Bytes that end a plain text run. The vector scans compare against exactly
+// these, so a new markdown character needs an entry here and a class below.
+inline constexpr char text_stop_chars[] = {'#', '*', '[', '!', '-', '`', '\n', '\0'};
+
+struct CharTable {
+    uint8_t entry[256];
+
+    constexpr CharTable() : entry{} {
+        entry[static_cast<unsigned char>('#')] = CC_HEADING;
+        entry[static_cast<unsigned char>('*')] = CC_EMPHASIS;
+        entry[static_cast<unsigned char>('[')] = CC_LINK;
+        entry[static_cast<unsigned char>('!')] = CC_IMAGE;
+        entry[static_cast<unsigned char>('-')] = CC_LIST;
+        entry[static_cast<unsigned char>('`')] = CC_CODE;
+        entry[static_cast<unsigned char>('\n')] = CC_NEWLINE;
+        entry[0] = CC_END;
+        for (char c : {' ', '\t', '\n', '\v', '\f', '\r'}) {
+            entry[static_cast<unsigned char>(c)] |= CHAR_SPACE;
+        }
+    }
+
+    constexpr bool matchesTextStops() const {
+        size_t classified = 0;
+        for (uint8_t e : entry) {
+            classified += (e & CHAR_CLASS_MASK) != CC_PLAIN;
+        }
+        for (char c : text_stop_chars) {
+            if ((entry[static_cast<unsigned char>(c)] & CHAR_CLASS_MASK) == CC_PLAIN) {
+                return false;
+            }
+        }
+        return classified == sizeof(text_stop_chars);
+    }
+};
+
+inline constexpr CharTable char_table;
+static_assert(char_table.matchesTextStops(), "text_stop_chars must list every classified byte");
+
+inline CharClass char_class(char c) {
+    return static_cast<CharClass>(char_table.entry[static_cast<unsigned char>(c)] & CHAR_CLASS_MASK);
+}
+
+inline bool is_space(char c) {
+    return (char_table.entry[static_cast<unsigned char>(c)] & CHAR_SPACE) != 0;
+}
+
+inline bool is_text_stop(char c) {
+    return char_class(c) != CC_PLAIN;
+}
+
+// Returns the position of the first text-stop byte at or after `from`, or
+// text.size() if there is none. Prose is mostly plain bytes, so compare a whole
+// vector at a time and only fall back to byte checks for the tail.
+inline size_t find_text_stop(std::string_view text, size_t from) {
+    const char* data = text.data();
+    size_t n = text.size();
+    size_t i = from;
+#if defined(__AVX2__)
+    for (; i + 32 <= n; i += 32) {
+        __m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i));
+        __m256i hit = _mm256_setzero_si256();
+#pragma GCC unroll 8
+        for (char c : text_stop_chars) {
+            hit = _mm256_or_si256(hit, _mm256_cmpeq_epi8(chunk, _mm256_set1_epi8(c)));
+        }
+        unsigned mask = static_cast<unsigned>(_mm256_movemask_epi8(hit));
+        if (mask != 0) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+#endif
+#if defined(__SSE2__)
+    for (; i + 16 <= n; i += 16) {
+        __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+        __m128i hit = _mm_setzero_si128();
+#pragma GCC unroll 8
+        for (char c : text_stop_chars) {
+            hit = _mm_or_si128(hit, _mm_cmpeq_epi8(chunk, _mm_set1_epi8(c)));
+        }
+        unsigned mask = static_cast<unsigned>(_mm_movemask_epi8(hit));
+        if (mask != 0) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+#endif
+    for (; i < n; i++) {
+        if (is_text_stop(data[i])) {
+            return i;
+        }
+    }
+    return n;
+}
+
+// A fence is "```" at the start of a line. The first one opens a code block and
+// the next one closes it, whatever follows either on its line.
+inline bool is_fence(std::string_view text, size_t pos) {
+    return (pos == 0 || text[pos - 1] == '\n') && text.compare(pos, 3, "```") == 0;
+}
+
+// First '\n' at or after `from` that is followed by another '\n' or a '`', the
+// only line ends where a block can end or a code block open, or npos. Lines
+// that end in neither cost no more than their bytes.
+inline size_t find_block_mark(std::string_view text, size_t from) {
+    const char* data = text.data();
+    size_t n = text.size();
+    size_t i = from;
+#if defined(__AVX2__)
+    for (; i + 33 <= n; i += 32) {
+        __m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i));
+        __m256i after = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i + 1));
+        __m256i hit = _mm256_and_si256(
+            _mm256_cmpeq_epi8(chunk, _mm256_set1_epi8('\n')),
+            _mm256_or_si256(_mm256_cmpeq_epi8(after, _mm256_set1_epi8('\n')),
+                            _mm256_cmpeq_epi8(after, _mm256_set1_epi8('`'))));
+        unsigned mask = static_cast<unsigned>(_mm256_movemask_epi8(hit));
+        if (mask != 0) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+#endif
+#if defined(__SSE2__)
+    for (; i + 17 <= n; i += 16) {
+        __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+        __m128i after = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i + 1));
+        __m128i hit = _mm_and_si128(
+            _mm_cmpeq_epi8(chunk, _mm_set1_epi8('\n')),
+            _mm_or_si128(_mm_cmpeq_epi8(after, _mm_set1_epi8('\n')), _mm_cmpeq_epi8(after, _mm_set1_epi8('`'))));
+        unsigned mask = static_cast<unsigned>(_mm_movemask_epi8(hit));
+        if (mask != 0) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+#endif
+    for (; i + 1 < n; i++) {
+        if (data[i] == '\n' && (data[i + 1] == '\n' || data[i + 1] == '`')) {
+            return i;
+        }
+    }
+    return std::string_view::npos;
+}
+
+// First fence starting in [from, to], or npos
+inline size_t find_fence(std::string_view text, size_t from, size_t to) {
+    const char* data = text.data();
+    size_t end = std::min(to + 3, text.size());
+    while (from + 3 <= end) {
+        auto hit = static_cast<const char*>(::memmem(data + from, end - from, "```", 3));
+        if (hit == nullptr) {
+            break;
+        }
+        size_t pos = hit - data;
+        if (pos == 0 || data[pos - 1] == '\n') {
+            return pos;
+        }
+        from = pos + 1;
+    }
+    return std::string_view::npos;
+}
+
+// Start of the first closing fence at or after `body`, the start of a code
+// block's contents (always past its opening line), or npos. A single memmem
+// jumps over the whole body.
+inline size_t find_closing_fence(std::string_view text, size_t body) {
+    if (body == 0 || body >= text.size()) {
+        return std::string_view::npos;
+    }
+    const char* data = text.data();
+    auto hit = static_cast<const char*>(::memmem(data + body - 1, text.size() - body + 1, "\n```", 4));
+    return hit == nullptr ? std::string_view::npos : hit - data + 1;
+}
+
+// Finds block boundaries: blank lines ("\n\n") outside fenced code blocks.
+// Tokens span neither, so the text on either side of a boundary lexes the same
+// on its own as it does as part of the whole document. The scan state survives
+// text being appended, so a growing buffer is scanned once overall.
+struct BlockScanner {
+    size_t pos = 0;                             // where the scan resumes
+    size_t fence = std::string_view::npos;      // body of the open code block
+
+    explicit BlockScanner(size_t from = 0) : pos(from) {}
+
+    // Position just past the next boundary, or npos once the text runs out
+    size_t next(std::string_view text) {
+        while (true) {
+            if (fence != std::string_view::npos) {
+                size_t close = find_closing_fence(text, std::max(fence, pos));
+                if (close == std::string_view::npos) {
+                    // A closing fence may still come in with the next bytes
+                    pos = std::max(pos, text.size() >= 2 ? text.size() - 2 : 0);
+                    return std::string_view::npos;
+                }
+                fence = std::string_view::npos;
+                pos = std::min(text.find('\n', close), text.size());
+            }
+
+            // One pass over the line ends: a blank line is a boundary and a fence
+            // at the start of a line opens a code block
+            size_t opened = is_fence(text, pos) ? pos : std::string_view::npos;
+            size_t boundary = std::string_view::npos;
+            size_t mark = opened == std::string_view::npos ? find_block_mark(text, pos) : std::string_view::npos;
+            while (mark != std::string_view::npos) {
+                if (text[mark + 1] == '\n') {
+                    boundary = mark + 2;
+                    break;
+                }
+                if (text.compare(mark + 1, 3, "```") == 0) {
+                    opened = mark + 1;
+                    break;
+                }
+                mark = find_block_mark(text, mark + 1);
+            }
+            if (opened != std::string_view::npos) {
+                size_t opened_end = text.find('\n', opened);
+                fence = opened_end == std::string_view::npos ? text.size() : opened_end + 1;
+                pos = fence;
+                continue;
+            }
+            if (boundary == std::string_view::npos) {
+                pos = std::max(pos, text.size() >= 2 ? text.size() - 2 : 0);
+                return boundary;
+            }
+            pos = boundary;
+            return pos;
+        }
+    }
+
+    // The caller dropped the first `count` bytes of the text
+    void shift(size_t count) {
+        pos -= count;
+        if (fence != std::string_view::npos) {
+            fence -= count;
+        }
+    }
+};
+
+// Position just past the next block boundary at or after `from`, which must not
+// be inside a code block, or npos
+inline size_t next_block_boundary(std::string_view text, size_t from) {
+    return BlockScanner(from).next(text);
+}
+
 /********************
 *      Parser       *
 *********************/
@@ -35,10 +459,13 @@ typedef enum Type {
 class Token {
 private:
     TokenType type;
-    std::string value;
+    std::string_view value;     // span of the lexer's input (or of its arena)
+    std::string_view url;       // LINK and IMAGE: value holds the text; CODE_BLOCK: info string
     bool is_eof;
 public:
-    Token(TokenType type, std::string value) : type(type), value(value), is_eof(false) {}
+    Token(TokenType type, std::string_view value) : type(type), value(value), is_eof(false) {}
+    Token(TokenType type, std::string_view value, std::string_view url)
+        : type(type), value(value), url(url), is_eof(false) {}
     
     static Token createEOF() {
         Token token(TEXT, "");
@@ -50,10 +477,14 @@ public:
         return type;
     }
     
-    std::string getValue() const {
+    std::string_view getValue() const {
         return value;
     }
 
+    std::string_view getUrl() const {
+        return url;
+    }
+
     bool isEOF() const {
         return is_eof;
     }
@@ -63,11 +494,143 @@ public:
     // }
 };
 
+/********************
+*      Outline      *
+*********************/
+
+struct Heading {
+    int level;
+    std::string_view text;  // span of the lexed input
+    size_t offset;          // of the heading's first '#' in the input
+    std::string anchor;     // id of the rendered heading, unique in its document
+};
+
+// The headings of a document in order, collected by the lexer as it meets them.
+// Anchors are slugs of the heading text, numbered from -1 on when they repeat.
+class Outline {
+private:
+    std::vector<Heading> entries;
+    std::unordered_map<std::string, size_t> taken;  // anchor -> repeats so far
+
+    // Lowercase letters, digits, '-' and '_' are kept, spaces become '-' and
+    // other ASCII is dropped. Bytes of UTF-8 sequences are kept as they are.
+    static std::string slug(std::string_view text) {
+        std::string anchor;
+        for (char c : text) {
+            if (c >= 'A' && c <= 'Z') {
+                anchor += static_cast<char>(c - 'A' + 'a');
+            } else if ((c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') || c == '-' || c == '_' ||
+                       static_cast<unsigned char>(c) >= 0x80) {
+                anchor += c;
+            } else if (c == ' ') {
+                anchor += '-';
+            }
+        }
+        return anchor.empty() ? "section" : anchor;
+    }
+
+public:
+    void add(int level, std::string_view text, size_t offset) {
+        std::string anchor = slug(text);
+        auto [found, fresh] = taken.try_emplace(anchor, 0);
+        if (!fresh) {
+            size_t& repeats = found->second;
+            std::string base = anchor;
+            do {
+                anchor = base + "-" + std::to_string(++repeats);
+            } while (!taken.try_emplace(anchor, 0).second);
+        }
+        entries.push_back(Heading{level, text, offset, std::move(anchor)});
+    }
+
+    // Adds the headings of a piece lexed on its own that starts at `base`
+    void append(const Outline& piece, size_t base) {
+        for (const Heading& heading : piece.entries) {
+            add(heading.level, heading.text, heading.offset + base);
+        }
+    }
+
+    void clear() {
+        entries.clear();
+        taken.clear();
+    }
+
+    const std::vector<Heading>& headings() const {
+        return entries;
+    }
+
+    size_t size() const {
+        return entries.size();
+    }
+
+    const Heading& operator[](size_t index) const {
+        return entries[index];
+    }
+};
+
+// The lexer borrows its input: the caller must keep the text alive for as long as
+// the lexer and any of its tokens are in use. Values that are not a contiguous
+// span of the input (link text with escaped brackets) are built in a
+// reusable scratch string and copied into an arena, which must outlive the tokens
+// as well. Without an arena from the caller the lexer creates its own on demand.
 class Lexer {
 private:
-    std::string text;
+    enum EmphasisKind : uint8_t {
+        EM_LITERAL,     // matched nothing, so it is text
+        EM_OPEN,
+        EM_CLOSE,
+        EM_INNER,       // second '*' of a bold delimiter
+    };
+
+    // One per '*' of the line being lexed, in order
+    struct EmphasisMark {
+        size_t offset;
+        EmphasisKind kind;
+        uint8_t length;     // OPEN and CLOSE: 1 for italic, 2 for bold
+        bool leaf;          // OPEN: no emphasis inside, so it becomes one BOLD or ITALIC token
+        size_t partner;     // OPEN: index of its CLOSE
+    };
+
+    // Part of a '*' run that may still open emphasis: marks [first, first + remaining)
+    struct EmphasisOpener {
+        size_t first;
+        size_t remaining;
+        bool nested;
+    };
+
+    std::string_view text;
     size_t pos;
     char current_char;
+    Arena* arena;
+    std::unique_ptr<Arena> own_arena;
+    std::string scratch;
+    std::pmr::vector<EmphasisMark> marks;
+    std::pmr::vector<EmphasisOpener> openers;
+    size_t marks_end = 0;       // end of the line `marks` covers
+    size_t mark_cursor = 0;     // first mark at or after pos
+    size_t delimiter_cursor = 0; // first OPEN or CLOSE mark at or after pos, inside emphasis
+    size_t emphasis_depth = 0;  // OPEN tokens emitted and not yet closed
+
+    struct BacktickRun {
+        size_t offset;
+        size_t length;
+        size_t next_same;       // index of the next run of the same length, or npos
+    };
+
+    // Both runs included
+    struct CodeSpan {
+        size_t start;
+        size_t content_start;
+        size_t content_end;
+        size_t end;
+    };
+
+    std::pmr::vector<BacktickRun> backtick_runs;
+    std::pmr::vector<size_t> last_run_of_length;
+    std::pmr::vector<CodeSpan> code_spans;
+    size_t code_end = 0;        // end of the paragraph `code_spans` covers
+    size_t code_cursor = 0;     // first span starting at or after pos
+    Outline* outline = nullptr;
 
     void advance() {
         pos++;
@@ -78,6 +641,11 @@ private:
         }
     }
 
+    void advance_to(size_t new_pos) {
+        pos = new_pos;
+        current_char = pos < text.length() ? text[pos] : '\0';
+    }
+
     char peek() {
         size_t peek_pos = pos + 1;
         if (peek_pos >= text.length()) {
@@ -86,20 +654,41 @@ private:
         return text[peek_pos];
     }
 
-    std::string collect_until(char delimiter, bool include_delimiter = false) {
-        std::string result;
+    std::string_view slice(size_t start, size_t end) const {
+        return text.substr(start, end - start);
+    }
+
+    // Moves the value built in scratch into the arena
+    std::string_view spill() {
+        if (arena == nullptr) {
+            own_arena = std::make_unique<Arena>(4 * 1024);
+            arena = own_arena.get();
+        }
+        return arena->copy(scratch);
+    }
+
+    void append_unescaped(std::string_view raw) {
+        for (size_t i = 0; i < raw.size(); i++) {
+            if (raw[i] == '\\' && i + 1 < raw.size() && raw[i + 1] == '[') {
+                i++;
+            }
+            scratch += raw[i];
+        }
+    }
+
+    std::string_view collect_until(char delimiter, bool include_delimiter = false) {
+        size_t start = pos;
         while (current_char != '\0' && current_char != delimiter && current_char != '\n') {
-            result += current_char;
             advance();
         }
         if (include_delimiter && current_char == delimiter) {
-            result += current_char;
             advance();
         }
-        return result;
+        return slice(start, pos);
     }
 
     Token handle_heading() {
+        size_t start = pos;
         int level = 1;
         advance();
         
@@ -108,18 +697,22 @@ private:
             advance();
         }
 
-        if (!isspace(current_char)) {
-            std::string rest = collect_until('\n');
+        if (!is_space(current_char)) {
+            collect_until('\n');
+            std::string_view value = slice(start, pos);
             if (current_char == '\n') advance();
-            return Token(TEXT, std::string(level, '#') + rest);
+            return Token(TEXT, value);
         }
         
-        while (isspace(current_char) && current_char != '\n') {
+        while (is_space(current_char) && current_char != '\n') {
             advance();
         }
         
-        std::string content = collect_until('\n');
+        std::string_view content = collect_until('\n');
         if (current_char == '\n') advance();
+        if (outline != nullptr) {
+            outline->add(level, content, start);
+        }
         
         switch (level) {
             case 1: return Token(H1, content);
@@ -128,47 +721,284 @@ private:
             case 4: return Token(H4, content);
             case 5: return Token(H5, content);
             case 6: return Token(H6, content);
-            default: return Token(TEXT, std::string(level, '#') + content);
+            default: return Token(TEXT, slice(start, pos));
+        }
+    }
+
+    // Finds the code spans from `from` to the end of its paragraph. Each run of
+    // backticks is linked to the next run of the same length in one pass from
+    // the right, so pairing them from the left takes one step per run: an
+    // opener's closer is its link, and the runs in between are code.
+    void index_code_spans(size_t from) {
+        const char* data = text.data();
+        size_t end = std::min(text.find("\n\n", from), text.size());
+        code_spans.clear();
+        code_cursor = 0;
+
+        // Without a backtick there is no fence to stop at either
+        auto tick = static_cast<const char*>(std::memchr(data + from, '`', end - from));
+        if (tick != nullptr) {
+            end = std::min(find_fence(text, tick - data, end), end);
+            auto nul = static_cast<const char*>(std::memchr(data + from, '\0', end - from));
+            if (nul != nullptr) {
+                end = nul - data;
+            }
+        }
+        code_end = end;
+
+        backtick_runs.clear();
+        size_t longest = 0;
+        while (tick != nullptr && tick < data + end) {
+            size_t offset = tick - data;
+            size_t length = 1;
+            while (offset + length < end && data[offset + length] == '`') {
+                length++;
+            }
+            backtick_runs.push_back({offset, length, std::string_view::npos});
+            longest = std::max(longest, length);
+            size_t next = offset + length;
+            tick = static_cast<const char*>(std::memchr(data + next, '`', end - next));
+        }
+        if (backtick_runs.size() < 2) {
+            return;
+        }
+
+        last_run_of_length.assign(longest + 1, std::string_view::npos);
+        for (size_t i = backtick_runs.size(); i-- > 0;) {
+            BacktickRun& run = backtick_runs[i];
+            run.next_same = last_run_of_length[run.length];
+            last_run_of_length[run.length] = i;
+        }
+        for (size_t i = 0; i < backtick_runs.size();) {
+            const BacktickRun& open = backtick_runs[i];
+            if (open.next_same == std::string_view::npos) {
+                i++;
+                continue;
+            }
+            const BacktickRun& close = backtick_runs[open.next_same];
+            code_spans.push_back({open.offset, open.offset + open.length, close.offset, close.offset + close.length});
+            i = open.next_same + 1;
+        }
+    }
+
+    // Index of the first code span starting at or after `offset`, which must not
+    // be behind pos. A span whose opening run went into another token is dead.
+    size_t next_code_span(size_t offset) {
+        if (offset >= code_end) {
+            index_code_spans(offset);
+        }
+        while (code_cursor < code_spans.size() && code_spans[code_cursor].start < offset) {
+            code_cursor++;
+        }
+        return code_cursor;
+    }
+
+    size_t code_span_start(size_t span) const {
+        return span < code_spans.size() ? code_spans[span].start : std::string_view::npos;
+    }
+
+    // Matches every '*' from pos to the end of the line in one pass. Runs are
+    // taken left to right; a run that follows a non-space first closes what it
+    // can of the innermost open run, two stars at a time while both sides have
+    // two, and if a non-space follows, whatever is left may open. Matching only
+    // against the innermost opener keeps the spans properly nested, and each
+    // step either uses up stars or pops an opener, so the pass is linear however
+    // many stars go unmatched.
+    void resolve_emphasis() {
+        marks.clear();
+        mark_cursor = 0;
+        delimiter_cursor = 0;
+        const char* data = text.data();
+        const char* end = data + std::min(text.find('\n', pos), text.size());
+        const char* nul = static_cast<const char*>(std::memchr(data + pos, '\0', end - (data + pos)));
+        end = nul != nullptr ? nul : end;
+        // Stars inside code spans are code
+        size_t first_span = next_code_span(pos);
+        size_t span = first_span;
+        for (const char* star = data + pos; star != nullptr && star < end;
+             star = static_cast<const char*>(std::memchr(star + 1, '*', end - star - 1))) {
+            size_t offset = star - data;
+            while (span < code_spans.size() && code_spans[span].end <= offset) {
+                span++;
+            }
+            if (span < code_spans.size() && code_spans[span].start <= offset) {
+                star = data + code_spans[span].end - 1;
+                if (star + 1 >= end) {
+                    break;
+                }
+                continue;
+            }
+            marks.push_back({offset, EM_LITERAL, 0, false, 0});
+        }
+        marks_end = end - data;
+        span = first_span;
+
+        for (size_t run = 0; run < marks.size();) {
+            size_t run_end = run + 1;
+            while (run_end < marks.size() && marks[run_end].offset == marks[run_end - 1].offset + 1) {
+                run_end++;
+            }
+            size_t before = marks[run].offset;
+            size_t after = marks[run_end - 1].offset + 1;
+
+            // A code span since the last run sits inside whatever is open
+            while (span < code_spans.size() && code_spans[span].start < before) {
+                if (!openers.empty()) {
+                    openers.back().nested = true;
+                }
+                span++;
+            }
+
+            bool can_close = before > 0 && !is_space(text[before - 1]);
+            bool can_open = after < marks_end && !is_space(text[after]);
+
+            size_t closer = run;
+            while (can_close && closer < run_end && !openers.empty()) {
+                EmphasisOpener& top = openers.back();
+                size_t length = run_end - closer >= 2 && top.remaining >= 2 ? 2 : 1;
+                size_t opener = top.first + top.remaining - length;
+                marks[opener].kind = EM_OPEN;
+                marks[opener].length = static_cast<uint8_t>(length);
+                marks[opener].leaf = !top.nested;
+                marks[opener].partner = closer;
+                marks[closer].kind = EM_CLOSE;
+                marks[closer].length = static_cast<uint8_t>(length);
+                if (length == 2) {
+                    marks[opener + 1].kind = EM_INNER;
+                    marks[closer + 1].kind = EM_INNER;
+                }
+                closer += length;
+                top.remaining -= length;
+                if (top.remaining == 0) {
+                    openers.pop_back();
+                }
+                // What is still open encloses the span just closed
+                if (!openers.empty()) {
+                    openers.back().nested = true;
+                }
+            }
+            if (can_open && closer < run_end) {
+                openers.push_back({closer, run_end - closer, false});
+            }
+            run = run_end;
+        }
+        openers.clear();
+    }
+
+    // The mark of the '*' at `offset`. A star that has none, because it was left
+    // out as code, is text.
+    EmphasisMark mark_at(size_t offset) {
+        if (offset >= marks_end) {
+            resolve_emphasis();
+        }
+        while (mark_cursor < marks.size() && marks[mark_cursor].offset < offset) {
+            mark_cursor++;
         }
+        if (mark_cursor == marks.size() || marks[mark_cursor].offset != offset) {
+            return EmphasisMark{offset, EM_LITERAL, 0, false, 0};
+        }
+        return marks[mark_cursor];
     }
 
     Token handle_emphasis() {
-        std::string original = "*";
-        advance();
-        
-        if (current_char == '*') {
-            // Bold case
-            advance();
-            std::string content = collect_until('*');
-            if (current_char == '*' && peek() == '*') {
-                advance();
-                advance();
-                return Token(BOLD, content);
+        size_t start = pos;
+        const EmphasisMark mark = mark_at(pos);
+
+        if (mark.kind == EM_OPEN) {
+            bool bold = mark.length == 2;
+            if (mark.leaf) {
+                const EmphasisMark& close = marks[mark.partner];
+                std::string_view content = slice(start + mark.length, close.offset);
+                advance_to(close.offset + close.length);
+                return Token(bold ? BOLD : ITALIC, content);
             }
-            return Token(TEXT, "**" + content + (current_char == '*' ? "*" : ""));
-        } else {
-            // Italic case
-            std::string content;
-            while (current_char != '\0' && current_char != '\n') {
-                if (current_char == '*') {
-                    advance();
-                    return Token(ITALIC, content);
+            emphasis_depth++;
+            advance_to(start + mark.length);
+            return Token(bold ? BOLD_OPEN : ITALIC_OPEN, std::string_view());
+        }
+        if (mark.kind == EM_CLOSE && emphasis_depth > 0) {
+            emphasis_depth--;
+            advance_to(start + mark.length);
+            return Token(mark.length == 2 ? BOLD_CLOSE : ITALIC_CLOSE, std::string_view());
+        }
+
+        // Unmatched stars are text, as is a closer whose opener went into a link
+        size_t end = start + (mark.kind == EM_CLOSE ? mark.length : 1);
+        for (size_t i = mark_cursor; i < marks.size() && marks[i].offset <= end; i++) {
+            if (marks[i].offset == end) {
+                if (marks[i].kind != EM_LITERAL) {
+                    break;
+                }
+                end++;
+            }
+        }
+        advance_to(end);
+        return Token(TEXT, slice(start, end));
+    }
+
+    // Inside emphasis everything up to the next delimiter or code span is text.
+    // The delimiter search resumes where the last one stopped, so literal stars
+    // between code spans are passed over once, not once per span.
+    Token handle_emphasis_content() {
+        size_t& next = delimiter_cursor;
+        while (next < marks.size() &&
+               (marks[next].offset < pos || (marks[next].kind != EM_OPEN && marks[next].kind != EM_CLOSE))) {
+            next++;
+        }
+        size_t delimiter = next < marks.size() ? marks[next].offset : marks_end;
+        size_t code = code_span_start(next_code_span(pos));
+        if (delimiter == pos && next < marks.size()) {
+            return handle_emphasis();
+        }
+        if (code == pos) {
+            return handle_code();
+        }
+        size_t start = pos;
+        advance_to(std::max(start + 1, std::min(delimiter, code)));
+        return Token(TEXT, slice(start, pos));
+    }
+
+    // Every byte the bracket scan looks at ends up in the returned token, even
+    // when no link matches, so a run of unmatched '[' costs one pass and never
+    // rescans. Keep it that way: untrusted input must lex in linear time.
+    // The link destination, up to ')' on this line. A code span that opens in it
+    // is taken whole, as in the link text: one cut short would leave the stars
+    // after its opening run out of the emphasis marks.
+    std::string_view collect_url() {
+        size_t start = pos;
+        while (current_char != '\0' && current_char != ')' && current_char != '\n') {
+            if (current_char == '`') {
+                size_t span = next_code_span(pos);
+                if (code_span_start(span) == pos && slice(pos, code_spans[span].end).find('\n') == std::string_view::npos) {
+                    advance_to(code_spans[span].end);
+                    continue;
                 }
-                content += current_char;
-                advance();
             }
-            return Token(TEXT, "*" + content);
+            advance();
         }
+        return slice(start, pos);
     }
 
     Token handle_link() {
+        size_t start = pos;
         advance();
-        std::string text;
+        size_t text_start = pos;
+        size_t text_end = pos;
+        bool escaped = false;
         int bracket_count = 1;
         
-        while (current_char != '\0') {
+        // Link text may wrap lines but never crosses a blank line or a fence.
+        // Brackets inside code spans do not count.
+        while (current_char != '\0' && !(current_char == '\n' && (peek() == '\n' || is_fence(text, pos + 1)))) {
+            if (current_char == '`') {
+                size_t span = next_code_span(pos);
+                if (code_span_start(span) == pos) {
+                    advance_to(code_spans[span].end);
+                    continue;
+                }
+            }
             if (current_char == '\\' && peek() == '[') {
-                text += '[';
+                escaped = true;
                 advance();
                 advance();
                 continue;
@@ -179,76 +1009,166 @@ private:
             } else if (current_char == ']') {
                 bracket_count--;
                 if (bracket_count == 0) {
+                    text_end = pos;
                     advance();
                     break;
                 }
             }
-            text += current_char;
             advance();
         }
         
         if (bracket_count > 0) {
-            return Token(TEXT, "[" + text);
+            text_end = pos;
         }
-        
-        if (current_char != '(') {
-            return Token(TEXT, "[" + text + "]");
+
+        // Everything consumed so far, unescaped only when the text needs it
+        auto consumed = [&]() -> std::string_view {
+            if (!escaped) {
+                return slice(start, pos);
+            }
+            scratch.assign("[");
+            append_unescaped(slice(text_start, text_end));
+            scratch.append(slice(text_end, pos));
+            return spill();
+        };
+
+        if (bracket_count > 0 || current_char != '(') {
+            return Token(TEXT, consumed());
         }
         
         advance();
-        std::string url = collect_until(')');
+        std::string_view url = collect_url();
         if (current_char != ')') {
-            return Token(TEXT, "[" + text + "](" + url);
+            return Token(TEXT, consumed());
         }
         
         advance();
-        return Token(LINK, text + "|" + url);
+        std::string_view link_text = slice(text_start, text_end);
+        if (escaped) {
+            scratch.clear();
+            append_unescaped(link_text);
+            link_text = spill();
+        }
+        return Token(LINK, link_text, url);
     }
 
     Token handle_image() {
+        size_t start = pos;
         advance();
         if (current_char != '[') {
-            return Token(TEXT, "!");
+            return Token(TEXT, slice(start, pos));
         }
         Token linkToken = handle_link();
         if (linkToken.getType() == LINK) {
-            return Token(IMAGE, linkToken.getValue());
+            return Token(IMAGE, linkToken.getValue(), linkToken.getUrl());
         }
-        return Token(TEXT, "!" + linkToken.getValue());
+        std::string_view rest = linkToken.getValue();
+        if (rest.data() == text.data() + start + 1) {
+            return Token(TEXT, slice(start, start + 1 + rest.size()));
+        }
+        scratch.assign("!");
+        scratch.append(rest);
+        return Token(TEXT, spill());
     }
 
-    Token handle_list() {
-        advance();
-        
-        if (!isspace(current_char)) {
-            std::string rest = collect_until('\n');
-            if (current_char == '\n') {
-                advance();
+    // A fenced code block is one token whatever it holds. The closing fence is
+    // found with one memmem over the body, and the body is never looked at
+    // again until it is escaped in bulk. Other backtick runs start code spans,
+    // or are text if they close none.
+    Token handle_code() {
+        size_t start = pos;
+        if (!is_fence(text, pos)) {
+            size_t span = next_code_span(pos);
+            if (code_span_start(span) != pos) {
+                while (current_char == '`') {
+                    advance();
+                }
+                return Token(TEXT, slice(start, pos));
+            }
+
+            // One space on each side is padding, unless the code is all spaces
+            std::string_view code = slice(code_spans[span].content_start, code_spans[span].content_end);
+            if (code.size() >= 2 && code.front() == ' ' && code.back() == ' ' &&
+                code.find_first_not_of(' ') != std::string_view::npos) {
+                code = code.substr(1, code.size() - 2);
+            }
+            advance_to(code_spans[span].end);
+            return Token(CODE, code);
+        }
+
+        advance_to(pos + 3);
+        while (current_char == '`' || (is_space(current_char) && current_char != '\n')) {
+            advance();
+        }
+        std::string_view info = collect_until('\n');
+        while (!info.empty() && is_space(info.back())) {
+            info.remove_suffix(1);
+        }
+        if (current_char != '\n') {
+            return Token(CODE_BLOCK, std::string_view(), info);
+        }
+
+        size_t body = pos + 1;
+        size_t close = find_closing_fence(text, body);
+        size_t body_end = close == std::string_view::npos ? text.size() : close;
+        size_t next = close == std::string_view::npos ? text.size() : std::min(text.find('\n', close), text.size());
+
+        // The lexer stops at a NUL, even inside a code block or on its closing line
+        auto nul = static_cast<const char*>(std::memchr(text.data() + body, '\0', next - body));
+        if (nul != nullptr) {
+            next = nul - text.data();
+            body_end = std::min(body_end, next);
+        }
+        advance_to(next);
+        return Token(CODE_BLOCK, slice(body, body_end), info);
+    }
+
+    Token handle_list() {
+        size_t start = pos;
+        advance();
+        
+        // An item's text never starts on the next line, which may be a fence
+        if (!is_space(current_char) || current_char == '\n') {
+            collect_until('\n');
+            std::string_view value = slice(start, pos);
+            if (current_char == '\n') {
+                advance();
             }
-            return Token(TEXT, "-" + rest);
+            return Token(TEXT, value);
         }
         
         advance(); 
-        std::string content = collect_until('\n');
+        std::string_view content = collect_until('\n');
         if (current_char == '\n') advance();
         return Token(LIST, content);
     }
 
-    // TODO: add more characters as needed
-    bool is_markdown_char(char c) {
-        return c == '#' || c == '*' || c == '[' || c == '!' || c == '-';
-    }
-
 public:
-    Lexer(const std::string& text) : text(text), pos(0) {
+    Lexer(std::string_view text, Arena* arena = nullptr)
+        : text(text), pos(0), arena(arena),
+          marks(arena != nullptr ? arena : std::pmr::new_delete_resource()),
+          openers(arena != nullptr ? arena : std::pmr::new_delete_resource()),
+          backtick_runs(arena != nullptr ? arena : std::pmr::new_delete_resource()),
+          last_run_of_length(arena != nullptr ? arena : std::pmr::new_delete_resource()),
+          code_spans(arena != nullptr ? arena : std::pmr::new_delete_resource()) {
         current_char = text.empty() ? '\0' : text[0];
     }
 
+    // Adds every heading lexed from now on to `into`, or stops with nullptr
+    void collect_outline(Outline* into) {
+        outline = into;
+    }
+
     Token get_next_token() {
         if (current_char == '\0') {
             return Token::createEOF();
         }
 
+        // An open emphasis always closes on the same line
+        if (emphasis_depth > 0) {
+            return handle_emphasis_content();
+        }
+
         // Skip isolated newlines
         while (current_char == '\n') {
             advance();
@@ -257,358 +1177,3602 @@ public:
             }
         }
 
-        if (current_char == '#') {
-            return handle_heading();
+        switch (char_class(current_char)) {
+            case CC_HEADING: return handle_heading();
+            case CC_EMPHASIS: return handle_emphasis();
+            case CC_LINK: return handle_link();
+            case CC_IMAGE: return handle_image();
+            case CC_LIST: return handle_list();
+            case CC_CODE: return handle_code();
+            default: break;
         }
-        
-        if (current_char == '*') {
-            return handle_emphasis();
+
+        // Jump from one text-stop byte to the next; single newlines are part of the run
+        size_t start = pos;
+        while (true) {
+            advance_to(find_text_stop(text, pos));
+            if (current_char == '\n' && peek() != '\n') {
+                advance();
+                continue;
+            }
+            // If we see two newlines, stop collecting text
+            break;
         }
-        
-        if (current_char == '[') {
-            return handle_link();
+
+        // Trim trailing newlines from text content
+        std::string_view text_content = slice(start, pos);
+        while (!text_content.empty() && text_content.back() == '\n') {
+            text_content.remove_suffix(1);
         }
         
-        if (current_char == '!') {
-            return handle_image();
+        return Token(TEXT, text_content);
+    }
+};
+
+/********************
+*  Token Generator  *
+*********************/
+
+// Tokens lexed on demand by a coroutine, as a single-pass view that composes
+// with range adaptors. Nothing is lexed until the first token is asked for, and
+// leaving a loop over it stops lexing there. std::views::take steps once past
+// its last element, so behind a filter it lexes on to the next match; break out
+// of the loop instead where that matters. Token values are spans of the input
+// or the arena, as with Lexer::get_next_token.
+class TokenGenerator : public std::ranges::view_interface<TokenGenerator> {
+public:
+    struct promise_type {
+        const Token* current = nullptr;
+
+        TokenGenerator get_return_object() {
+            return TokenGenerator(std::coroutine_handle<promise_type>::from_promise(*this));
         }
-        
-        if (current_char == '-') {
-            return handle_list();
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        std::suspend_always final_suspend() noexcept { return {}; }
+        std::suspend_always yield_value(const Token& token) noexcept {
+            current = &token;
+            return {};
+        }
+        void return_void() {}
+        void unhandled_exception() { throw; }
+    };
+
+    class iterator {
+    private:
+        std::coroutine_handle<promise_type> coroutine;
+
+    public:
+        using value_type = Token;
+        using difference_type = std::ptrdiff_t;
+
+        iterator() = default;
+        explicit iterator(std::coroutine_handle<promise_type> coroutine) : coroutine(coroutine) {}
+
+        const Token& operator*() const {
+            return *coroutine.promise().current;
         }
 
-        std::string text_content;
-        while (current_char != '\0' && !is_markdown_char(current_char)) {
+        iterator& operator++() {
+            coroutine.resume();
+            return *this;
+        }
 
-            if (current_char == '\n' && peek() == '\n') {
-                // If we see two newlines, stop collecting text
-                break;
+        void operator++(int) {
+            ++*this;
+        }
+
+        bool operator==(std::default_sentinel_t) const {
+            return !coroutine || coroutine.done();
+        }
+    };
+
+    TokenGenerator() = default;
+
+    TokenGenerator(TokenGenerator&& other) noexcept : coroutine(std::exchange(other.coroutine, nullptr)) {}
+
+    TokenGenerator& operator=(TokenGenerator&& other) noexcept {
+        if (this != &other) {
+            if (coroutine) {
+                coroutine.destroy();
             }
-            text_content += current_char;
-            advance();
+            coroutine = std::exchange(other.coroutine, nullptr);
+        }
+        return *this;
+    }
+
+    ~TokenGenerator() {
+        if (coroutine) {
+            coroutine.destroy();
         }
+    }
 
-        // Trim trailing newlines from text content
-        while (!text_content.empty() && text_content.back() == '\n') {
-            text_content.pop_back();
+    // Single pass: begin() lexes the first token and may only be called once
+    iterator begin() {
+        if (coroutine) {
+            coroutine.resume();
         }
-        
-        return Token(TEXT, text_content);
+        return iterator(coroutine);
+    }
+
+    std::default_sentinel_t end() const {
+        return std::default_sentinel;
     }
-};
 
-class Parser {
 private:
-    std::unique_ptr<Lexer> lexer;
-    std::vector<Token> tokens;
-    std::string html;
-    
+    std::coroutine_handle<promise_type> coroutine;
+
+    explicit TokenGenerator(std::coroutine_handle<promise_type> coroutine) : coroutine(coroutine) {}
+};
+
+// Pulls tokens from a lexer the caller keeps alive. Once the generator is
+// dropped the lexer carries on from the first token that was not requested.
+TokenGenerator lex_tokens(Lexer& lexer) {
+    Token token = lexer.get_next_token();
+    while (!token.isEOF()) {
+        co_yield token;
+        token = lexer.get_next_token();
+    }
+}
+
+// Same over a lexer of its own; `text` and `arena` must outlive the tokens
+TokenGenerator lex_tokens(std::string_view text, Arena* arena = nullptr) {
+    Lexer lexer(text, arena);
+    Token token = lexer.get_next_token();
+    while (!token.isEOF()) {
+        co_yield token;
+        token = lexer.get_next_token();
+    }
+}
+
+static_assert(std::ranges::view<TokenGenerator> && std::ranges::input_range<TokenGenerator>);
+
+/********************
+*     Renderer      *
+*********************/
+
+// Entity for every byte that must be escaped in HTML text and attribute values,
+// empty for bytes that are copied as they are
+struct HtmlEscapeTable {
+    std::string_view entity[256];
+
+    constexpr HtmlEscapeTable() : entity{} {
+        entity[static_cast<unsigned char>('<')] = "&lt;";
+        entity[static_cast<unsigned char>('>')] = "&gt;";
+        entity[static_cast<unsigned char>('&')] = "&amp;";
+        entity[static_cast<unsigned char>('"')] = "&quot;";
+    }
+};
+
+inline constexpr HtmlEscapeTable html_escapes;
+
+// Position of the first byte at or after `from` that needs escaping, or
+// text.size(). Same shape as find_text_stop.
+inline size_t find_html_special(std::string_view text, size_t from) {
+    const char* data = text.data();
+    size_t n = text.size();
+    size_t i = from;
+#if defined(__AVX2__)
+    for (; i + 32 <= n; i += 32) {
+        __m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i));
+        __m256i hit = _mm256_or_si256(
+            _mm256_or_si256(_mm256_cmpeq_epi8(chunk, _mm256_set1_epi8('<')),
+                            _mm256_cmpeq_epi8(chunk, _mm256_set1_epi8('>'))),
+            _mm256_or_si256(_mm256_cmpeq_epi8(chunk, _mm256_set1_epi8('&')),
+                            _mm256_cmpeq_epi8(chunk, _mm256_set1_epi8('"'))));
+        unsigned mask = static_cast<unsigned>(_mm256_movemask_epi8(hit));
+        if (mask != 0) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+#endif
+#if defined(__SSE2__)
+    for (; i + 16 <= n; i += 16) {
+        __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+        __m128i hit = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(chunk, _mm_set1_epi8('<')),
+                         _mm_cmpeq_epi8(chunk, _mm_set1_epi8('>'))),
+            _mm_or_si128(_mm_cmpeq_epi8(chunk, _mm_set1_epi8('&')),
+                         _mm_cmpeq_epi8(chunk, _mm_set1_epi8('"'))));
+        unsigned mask = static_cast<unsigned>(_mm_movemask_epi8(hit));
+        if (mask != 0) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+#endif
+    for (; i < n; i++) {
+        if (!html_escapes.entity[static_cast<unsigned char>(data[i])].empty()) {
+            return i;
+        }
+    }
+    return n;
+}
+
+// Appends `text` with the bytes that need it replaced by entities. Copies runs
+// of safe bytes in bulk and only stops for the bytes that need an entity.
+inline void append_escaped(std::string& output, std::string_view text) {
+    size_t start = 0;
+    size_t special = find_html_special(text, 0);
+    while (special < text.size()) {
+        output.append(text.data() + start, special - start);
+        output += html_escapes.entity[static_cast<unsigned char>(text[special])];
+        start = special + 1;
+        special = find_html_special(text, start);
+    }
+    output.append(text.data() + start, text.size() - start);
+}
+
+/********************
+*   Output Sinks    *
+*********************/
+
+// Destination for rendered HTML. Writers append to buffer() directly and call
+// commit() at convenient points; once the buffer has grown past the sink's
+// threshold it is drained to the destination in one piece. flush() drains
+// whatever is left.
+class OutputSink {
+protected:
+    std::string pending;
+    size_t threshold;
+
+    virtual void drain(std::string_view bytes) = 0;
+
 public:
-    Parser() = default;
-    
-    std::string parse(const std::string& markdown) {
-        lexer = std::make_unique<Lexer>(markdown);
-        tokens.clear();
-        
-        Token token = lexer->get_next_token();
-        while (!token.isEOF()) {
-            tokens.push_back(token);
-            token = lexer->get_next_token();
+    explicit OutputSink(size_t threshold) : threshold(threshold) {}
+    virtual ~OutputSink() = default;
+
+    std::string& buffer() {
+        return pending;
+    }
+
+    void commit() {
+        if (pending.size() >= threshold) {
+            flush();
         }
-        
-        return tokensToHtml();
     }
-    
-private:
-    bool isInlineElement(TokenType type) {
-        return type == BOLD || type == ITALIC || type == LINK || type == IMAGE;
+
+    virtual void flush() {
+        if (!pending.empty()) {
+            drain(pending);
+            pending.clear();
+        }
     }
-    
-    bool isBlockElement(TokenType type) {
-        return type == H1 || type == H2 || type == H3 || 
-               type == H4 || type == H5 || type == H6 || 
-               type == LIST;
+};
+
+// Keeps all output in one growable buffer
+class BufferSink : public OutputSink {
+protected:
+    void drain(std::string_view) override {}
+
+public:
+    BufferSink() : OutputSink(SIZE_MAX) {}
+
+    void flush() override {}
+
+    const std::string& str() const {
+        return pending;
     }
-    
-    std::string tokensToHtml() {
-        std::stringstream output;
-        bool inList = false;
-        bool inParagraph = false;
-        
-        for (size_t i = 0; i < tokens.size(); i++) {
-            const Token& token = tokens[i];
-            TokenType type = token.getType();
-            
-            // Handle list wrapping
-            if (type == LIST) {
-                if (inParagraph) {
-                    output << "</p>\n";
-                    inParagraph = false;
-                }
-                if (!inList) {
-                    output << "<ul>\n";
-                    inList = true;
+
+    std::string take() {
+        std::string result = std::move(pending);
+        pending.clear();
+        return result;
+    }
+};
+
+// Buffered writes to a POSIX file descriptor, which stays owned by the caller.
+// Write errors are sticky: once one happens the rest of the output is dropped
+// and good() returns false.
+class FdSink : public OutputSink {
+private:
+    int fd;
+    int error = 0;
+
+protected:
+    void drain(std::string_view bytes) override {
+        while (!bytes.empty() && error == 0) {
+            ssize_t written = ::write(fd, bytes.data(), bytes.size());
+            if (written < 0) {
+                if (errno != EINTR) {
+                    error = errno;
                 }
-            } else if (inList) {
-                output << "</ul>\n";
-                inList = false;
+                continue;
             }
-            
-            // Handle paragraph wrapping
-            if ((type == TEXT || isInlineElement(type)) && !inParagraph) {
-                output << "<p>";
-                inParagraph = true;
-            } else if (inParagraph && isBlockElement(type)) {
-                output << "</p>\n";
-                inParagraph = false;
+            bytes.remove_prefix(static_cast<size_t>(written));
+        }
+    }
+
+public:
+    explicit FdSink(int fd, size_t buffer_size = 64 * 1024) : OutputSink(buffer_size), fd(fd) {
+        pending.reserve(buffer_size);
+    }
+
+    ~FdSink() override {
+        flush();
+    }
+
+    bool good() const {
+        return error == 0;
+    }
+
+    int lastError() const {
+        return error;
+    }
+};
+
+// Hands output to a user callback in pieces of roughly `threshold` bytes
+class CallbackSink : public OutputSink {
+private:
+    std::function<void(std::string_view)> callback;
+
+protected:
+    void drain(std::string_view bytes) override {
+        callback(bytes);
+    }
+
+public:
+    explicit CallbackSink(std::function<void(std::string_view)> callback, size_t threshold = 64 * 1024)
+        : OutputSink(threshold), callback(std::move(callback)) {}
+
+    ~CallbackSink() override {
+        flush();
+    }
+};
+
+// Everything a token's markup depends on besides the token itself
+struct RenderState {
+    bool inList = false;
+    bool inParagraph = false;
+    bool tight = false;     // inside a tight list item, where text gets no <p>
+
+    bool operator==(const RenderState& other) const {
+        return inList == other.inList && inParagraph == other.inParagraph && tight == other.tight;
+    }
+
+    bool operator!=(const RenderState& other) const {
+        return !(*this == other);
+    }
+};
+
+// Markup written before and after a token's escaped value. LINK and IMAGE put
+// their URL and the attribute glue between the opening markup and the value.
+struct TagPair {
+    std::string_view open;
+    std::string_view close;
+};
+
+struct TagTable {
+    TagPair tags[TOKEN_TYPE_COUNT];
+
+    constexpr TagPair operator[](TokenType type) const {
+        return tags[type];
+    }
+
+    constexpr TagTable() : tags{} {
+        tags[H1] = {"<h1>", "</h1>\n"};
+        tags[H2] = {"<h2>", "</h2>\n"};
+        tags[H3] = {"<h3>", "</h3>\n"};
+        tags[H4] = {"<h4>", "</h4>\n"};
+        tags[H5] = {"<h5>", "</h5>\n"};
+        tags[H6] = {"<h6>", "</h6>\n"};
+        tags[BOLD] = {"<strong>", "</strong>"};
+        tags[ITALIC] = {"<em>", "</em>"};
+        tags[LINK] = {"<a href=\"", "</a>"};
+        tags[IMAGE] = {"<img src=\"", "\">"};
+        tags[LIST] = {"<li>", "</li>\n"};
+        tags[BOLD_OPEN] = {"<strong>", ""};
+        tags[BOLD_CLOSE] = {"", "</strong>"};
+        tags[ITALIC_OPEN] = {"<em>", ""};
+        tags[ITALIC_CLOSE] = {"", "</em>"};
+        tags[CODE_BLOCK] = {"<pre><code", "</code></pre>\n"};
+        tags[CODE] = {"<code>", "</code>"};
+    }
+};
+
+inline constexpr TagTable tag_table;
+
+// Turns tokens into HTML one at a time, appending straight into a sink's buffer.
+// A token's markup only depends on the RenderState left behind by the tokens
+// before it, so tokens can be rendered as soon as they are lexed, and rendering
+// can resume anywhere given the state at that point.
+class HtmlRenderer {
+private:
+    OutputSink& sink;
+    std::string& output;
+    RenderState state;
+    ParseStats* stats;
+    const Outline* outline = nullptr;
+    size_t next_heading = 0;    // outline entry of the next heading rendered
+
+public:
+    explicit HtmlRenderer(OutputSink& sink, const RenderState& state = RenderState(), ParseStats* stats = nullptr)
+        : sink(sink), output(sink.buffer()), state(state), stats(stats) {}
+
+    const RenderState& getState() const {
+        return state;
+    }
+
+    // Gives the headings rendered from now on the ids of the outline's entries,
+    // which must be the same headings in the same order
+    void setOutline(const Outline* headings) {
+        outline = headings;
+        next_heading = 0;
+    }
+
+    void render(const Token& token) {
+        TokenType type = token.getType();
+        size_t output_before = output.size();
+        
+        // Handle list wrapping
+        if (type == LIST) {
+            if (state.inParagraph) {
+                output += "</p>\n";
+                state.inParagraph = false;
             }
-            
-            // Convert token to HTML
-            output << tokenToHtml(token);
-            
-            // Close paragraph if this is the last token or next token is a block element
-            if (inParagraph && (i == tokens.size()-1 || isBlockElement(tokens[i+1].getType()))) {
-                output << "</p>\n";
-                inParagraph = false;
+            if (!state.inList) {
+                output += "<ul>\n";
+                state.inList = true;
             }
+        } else if (state.inList) {
+            output += "</ul>\n";
+            state.inList = false;
         }
         
-        if (inList) output << "</ul>\n";
-        if (inParagraph) output << "</p>\n";
+        // Handle paragraph wrapping; a block element closes the open paragraph
+        if ((type == TEXT || isInlineElement(type)) && !state.inParagraph && !state.tight) {
+            output += "<p>";
+            state.inParagraph = true;
+        } else if (state.inParagraph && isBlockElement(type)) {
+            output += "</p>\n";
+            state.inParagraph = false;
+        }
         
-        return output.str();
+        // Convert token to HTML
+        tokenToHtml(token);
+        if constexpr (metrics_enabled) {
+            if (stats != nullptr) {
+                stats->tokens[type]++;
+                stats->bytes_out += output.size() - output_before;
+            }
+        }
+        sink.commit();
+    }
+
+    // Closes whatever is still open at the end of the document
+    void finish() {
+        size_t output_before = output.size();
+        if (state.inList) output += "</ul>\n";
+        if (state.inParagraph) output += "</p>\n";
+        state = RenderState();
+        if constexpr (metrics_enabled) {
+            if (stats != nullptr) {
+                stats->bytes_out += output.size() - output_before;
+            }
+        }
+    }
+
+private:
+    bool isInlineElement(TokenType type) {
+        return type == BOLD || type == ITALIC || type == LINK || type == IMAGE ||
+               type == BOLD_OPEN || type == BOLD_CLOSE || type == ITALIC_OPEN || type == ITALIC_CLOSE ||
+               type == CODE;
     }
     
-    std::string tokenToHtml(const Token& token) {
-        std::string content = escapeHtml(token.getValue());
-        
+    bool isHeading(TokenType type) {
+        return type == H1 || type == H2 || type == H3 || 
+               type == H4 || type == H5 || type == H6;
+    }
+
+    bool isBlockElement(TokenType type) {
+        return isHeading(type) || type == LIST || type == CODE_BLOCK;
+    }
+    
+    void tokenToHtml(const Token& token) {
+        TagPair tags = tag_table[token.getType()];
+        if (outline != nullptr && isHeading(token.getType()) && next_heading < outline->size()) {
+            output.append(tags.open.substr(0, tags.open.size() - 1));
+            output += " id=\"";
+            output += (*outline)[next_heading++].anchor;
+            output += "\">";
+        } else {
+            output += tags.open;
+        }
         switch (token.getType()) {
-            case TEXT: return content;
-            case H1: return "<h1>" + content + "</h1>\n";
-            case H2: return "<h2>" + content + "</h2>\n";
-            case H3: return "<h3>" + content + "</h3>\n";
-            case H4: return "<h4>" + content + "</h4>\n";
-            case H5: return "<h5>" + content + "</h5>\n";
-            case H6: return "<h6>" + content + "</h6>\n";
-            case BOLD: return "<strong>" + content + "</strong>";
-            case ITALIC: return "<em>" + content + "</em>";
-            case LIST: return "<li>" + content + "</li>\n";
-            case LINK: {
-                size_t sep = content.find('|');
-                std::string text = content.substr(0, sep);
-                std::string url = content.substr(sep + 1);
-                return "<a href=\"" + url + "\">" + text + "</a>";
-            }
-            case IMAGE: {
-                size_t sep = content.find('|');
-                std::string alt = content.substr(0, sep);
-                std::string src = content.substr(sep + 1);
-                return "<img src=\"" + src + "\" alt=\"" + alt + "\">";
-            }
-            default: return content;
+            case LINK:
+                escapeHtml(token.getUrl());
+                output += "\">";
+                break;
+            case IMAGE:
+                escapeHtml(token.getUrl());
+                output += "\" alt=\"";
+                break;
+            case CODE_BLOCK:
+                if (!token.getUrl().empty()) {
+                    output += " class=\"language-";
+                    escapeHtml(token.getUrl());
+                    output += "\"";
+                }
+                output += ">";
+                break;
+            default: break;
         }
+        escapeHtml(token.getValue());
+        output += tags.close;
     }
     
-    std::string escapeHtml(const std::string& text) {
-        std::stringstream output;
-        for (char c : text) {
-            switch (c) {
-                case '<': output << "&lt;"; break;
-                case '>': output << "&gt;"; break;
-                case '&': output << "&amp;"; break;
-                case '"': output << "&quot;"; break;
-                default: output << c;
+    void escapeHtml(std::string_view text) {
+        uint64_t started = metrics_clock();
+        append_escaped(output, text);
+        if constexpr (metrics_enabled) {
+            if (stats != nullptr) {
+                metrics_lap(stats->escape_ns, started);
             }
         }
-        return output.str();
     }
 };
 
+// Renders the outline as a <nav> of nested lists linking to the headings' ids. A
+// heading deeper than the one before starts a list inside its item; one no
+// deeper than an enclosing list's headings returns to that list. Writes nothing
+// for a document without headings.
+void writeToc(const Outline& outline, OutputSink& sink) {
+    if (outline.size() == 0) {
+        return;
+    }
+    std::string& output = sink.buffer();
+    std::vector<int> open;      // heading level of each open list
+    output += "<nav>\n";
+    for (const Heading& heading : outline.headings()) {
+        if (open.empty()) {
+            output += "<ul>\n";
+            open.push_back(heading.level);
+        } else if (heading.level > open.back()) {
+            output += "\n<ul>\n";
+            open.push_back(heading.level);
+        } else {
+            output += "</li>\n";
+            while (open.size() > 1 && heading.level <= open[open.size() - 2]) {
+                output += "</ul>\n</li>\n";
+                open.pop_back();
+            }
+        }
+        output += "<li><a href=\"#";
+        output += heading.anchor;
+        output += "\">";
+        append_escaped(output, heading.text);
+        output += "</a>";
+        sink.commit();
+    }
+    output += "</li>\n";
+    for (size_t i = open.size(); i-- > 0;) {
+        output += i > 0 ? "</ul>\n</li>\n" : "</ul>\n";
+    }
+    output += "</nav>\n";
+    sink.commit();
+}
 
 /********************
-*    LEXER TESTS    *
+*   Render Cache    *
 *********************/
 
-// Helper function to convert TokenType to string for debugging
-std::string tokenTypeToString(TokenType type) {
-    switch(type) {
-        case TEXT: return "TEXT";
-        case H1: return "H1";
-        case H2: return "H2";
-        case H3: return "H3";
-        case H4: return "H4";
-        case H5: return "H5";
-        case H6: return "H6";
-        case BOLD: return "BOLD";
-        case ITALIC: return "ITALIC";
-        case LINK: return "LINK";
-        case IMAGE: return "IMAGE";
-        case LIST: return "LIST";
-        default: return "UNKNOWN";
+struct ContentHash {
+    uint64_t low;
+    uint64_t high;
+
+    bool operator==(const ContentHash& other) const {
+        return low == other.low && high == other.high;
     }
+};
+
+inline uint64_t hash_mix(uint64_t a, uint64_t b) {
+    __extension__ using uint128 = unsigned __int128;
+    uint128 product = static_cast<uint128>(a) * b;
+    return static_cast<uint64_t>(product) ^ static_cast<uint64_t>(product >> 64);
 }
 
-void runTests() {
-    struct TestCase {
-        std::string name;
-        std::string input;
-        std::vector<std::pair<TokenType, std::string>> expected;
-    };
+inline uint64_t load_u64(const char* p) {
+    uint64_t value;
+    std::memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+// 128-bit non-cryptographic hash. Two independent multiply lanes take 32 bytes
+// per round. Its constants are public and inputs that collide are easy to
+// build, so a match only picks a candidate; callers compare the input itself.
+ContentHash hash_content(std::string_view text) {
+    constexpr uint64_t k0 = 0xa0761d6478bd642full, k1 = 0xe7037ed1a0b428dbull;
+    constexpr uint64_t k2 = 0x8ebc6af09c88c6e3ull, k3 = 0x589965cc75374cc3ull;
+    const char* p = text.data();
+    size_t n = text.size();
+    uint64_t a = k0 ^ n, b = k1 ^ (n * k2);
+    for (; n >= 32; p += 32, n -= 32) {
+        a = hash_mix(load_u64(p) ^ a ^ k1, load_u64(p + 8) ^ k2);
+        b = hash_mix(load_u64(p + 16) ^ b ^ k3, load_u64(p + 24) ^ k0);
+    }
+    if (n > 0) {
+        char tail[32] = {};
+        std::memcpy(tail, p, n);
+        a = hash_mix(load_u64(tail) ^ a ^ k1, load_u64(tail + 8) ^ k2);
+        b = hash_mix(load_u64(tail + 16) ^ b ^ k3, load_u64(tail + 24) ^ k0);
+    }
+    return ContentHash{hash_mix(a ^ k3, b ^ k1), hash_mix(b ^ k0, a ^ k2)};
+}
+
+struct ContentHashHasher {
+    size_t operator()(const ContentHash& hash) const {
+        return static_cast<size_t>(hash.low);
+    }
+};
+
+struct RenderCacheStats {
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t evictions = 0;
+    size_t entries = 0;
+    size_t bytes = 0;
+};
+
+// Rendered HTML keyed by the hash of its markdown, evicted least recently used
+// first once the entries' bytes exceed the budget. Each entry keeps its markdown
+// and is only served for the same bytes, so a hash collision is a miss. An entry
+// costs its markdown and HTML plus ENTRY_OVERHEAD for bookkeeping; one that
+// alone exceeds the budget is not stored. Safe to share between parsers on
+// different threads.
+class RenderCache {
+private:
+    struct Entry {
+        ContentHash key;
+        std::string markdown;
+        std::string html;
+    };
+
+    size_t budget;
+    std::list<Entry> entries;   // most recently used first
+    std::unordered_map<ContentHash, std::list<Entry>::iterator, ContentHashHasher> index;
+    RenderCacheStats counters;
+    mutable std::mutex mutex;
+
+    static size_t cost(const Entry& entry) {
+        return entry.markdown.size() + entry.html.size() + ENTRY_OVERHEAD;
+    }
+
+public:
+    static constexpr size_t ENTRY_OVERHEAD = sizeof(Entry) + 64;
+
+    explicit RenderCache(size_t budget) : budget(budget) {}
+
+    // Appends the cached HTML for `markdown`, whose hash is `key`, to the sink's
+    // buffer and returns true, or counts a miss and returns false
+    bool lookup(const ContentHash& key, std::string_view markdown, OutputSink& sink) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto found = index.find(key);
+        if (found == index.end() || found->second->markdown != markdown) {
+            counters.misses++;
+            return false;
+        }
+        counters.hits++;
+        entries.splice(entries.begin(), entries, found->second);
+        sink.buffer().append(found->second->html);
+        return true;
+    }
+
+    void insert(const ContentHash& key, std::string_view markdown, std::string_view html) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (markdown.size() + html.size() + ENTRY_OVERHEAD > budget || index.count(key) != 0) {
+            return;
+        }
+        entries.push_front(Entry{key, std::string(markdown), std::string(html)});
+        index.emplace(key, entries.begin());
+        counters.bytes += cost(entries.front());
+        while (counters.bytes > budget) {
+            counters.bytes -= cost(entries.back());
+            index.erase(entries.back().key);
+            entries.pop_back();
+            counters.evictions++;
+        }
+        counters.entries = entries.size();
+    }
+
+    RenderCacheStats stats() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return counters;
+    }
+};
+
+/********************
+*    Block Tree     *
+*********************/
+
+enum BlockKind : uint8_t {
+    BLOCK_DOCUMENT,
+    BLOCK_QUOTE,    // > 
+    BLOCK_LIST,     // the <ul> around consecutive items
+    BLOCK_ITEM,     // - item, continued by lines indented past its marker
+    BLOCK_LEAF,     // lines lexed as usual, with container prefixes stripped
+};
+
+// Nodes link to their parent, first and last child and next sibling, so the tree
+// can be walked in either direction without a stack
+struct BlockNode {
+    BlockKind kind;
+    BlockNode* parent = nullptr;
+    BlockNode* first_child = nullptr;
+    BlockNode* last_child = nullptr;
+    BlockNode* next = nullptr;
+    std::string_view content;   // BLOCK_LEAF only
+    size_t indent = 0;          // BLOCK_ITEM: columns its lines are indented by
+    bool loose = false;         // BLOCK_ITEM: more than one leaf, so each gets a <p>
+
+    explicit BlockNode(BlockKind kind) : kind(kind) {}
+};
+
+// Container structure of a document: blockquotes and nested lists, with the
+// ordinary markdown in between as leaves. Built in one pass over the lines with
+// an explicit stack of open containers. A line costs the bytes it consumes plus
+// the containers it closes, and each container closes once, so the build is
+// linear however deep the nesting. Nodes and copied leaf text come from the
+// arena, which must outlive the tree, as must the markdown.
+//
+// Simplifications: a blank line ends every blockquote, items are tight unless
+// they hold several leaves, lines never continue a paragraph lazily, and only
+// spaces count as indentation. A code block ends with its container.
+class BlockTree {
+private:
+    Arena& arena;
+    BlockNode* root;
+    std::pmr::vector<BlockNode*> open{&arena};         // root first, innermost last
+    std::pmr::vector<size_t> quotes{&arena};           // positions in `open` of blockquotes
+    std::pmr::vector<std::string_view> leaf_lines{&arena};
+    bool in_fence = false;      // the open leaf has an unclosed code block
+
+    BlockNode* add(BlockKind kind) {
+        BlockNode* node = new (arena.allocate(sizeof(BlockNode), alignof(BlockNode))) BlockNode(kind);
+        BlockNode* parent = open.back();
+        node->parent = parent;
+        if (parent->last_child != nullptr) {
+            parent->last_child->next = node;
+        } else {
+            parent->first_child = node;
+        }
+        parent->last_child = node;
+        return node;
+    }
+
+    void push(BlockKind kind) {
+        if (kind == BLOCK_QUOTE) {
+            quotes.push_back(open.size());
+        }
+        open.push_back(add(kind));
+    }
+
+    void closeTo(size_t depth) {
+        closeLeaf();
+        open.resize(depth);
+        while (!quotes.empty() && quotes.back() >= depth) {
+            quotes.pop_back();
+        }
+    }
+
+    // Leaf lines are one span of the source unless prefixes were stripped
+    // between them, in which case they are joined in the arena
+    void closeLeaf() {
+        if (leaf_lines.empty()) {
+            return;
+        }
+        std::string_view first = leaf_lines.front();
+        std::string_view last = leaf_lines.back();
+        size_t span = last.data() + last.size() - first.data();
+        size_t total = leaf_lines.size() - 1;
+        for (std::string_view line : leaf_lines) {
+            total += line.size();
+        }
+
+        BlockNode* parent = open.back();
+        if (parent->kind == BLOCK_ITEM && parent->first_child != nullptr) {
+            parent->loose = true;
+        }
+        BlockNode* leaf = add(BLOCK_LEAF);
+        if (span == total) {
+            leaf->content = std::string_view(first.data(), span);
+        } else {
+            char* joined = static_cast<char*>(arena.allocate(total, 1));
+            char* out = joined;
+            for (std::string_view line : leaf_lines) {
+                if (out != joined) {
+                    *out++ = '\n';
+                }
+                out = std::copy(line.begin(), line.end(), out);
+            }
+            leaf->content = std::string_view(joined, total);
+        }
+        leaf_lines.clear();
+        in_fence = false;
+    }
+
+    // Up to three spaces may come before a marker
+    static size_t skipIndent(std::string_view line, size_t p) {
+        for (size_t i = 0; i < 3 && p < line.size() && line[p] == ' '; i++) {
+            p++;
+        }
+        return p;
+    }
+
+    static bool isItemMarker(std::string_view line, size_t p) {
+        return p + 1 < line.size() && line[p] == '-' && (line[p + 1] == ' ' || line[p + 1] == '\t');
+    }
+
+    void addLine(std::string_view line) {
+        size_t first_text = line.find_first_not_of(" \t\r");
+        if (first_text == std::string_view::npos) {
+            // Items stay open across blank lines and so do their code blocks;
+            // blockquotes end
+            if (in_fence && quotes.empty()) {
+                leaf_lines.push_back(line.substr(line.size()));
+            } else {
+                closeTo(quotes.empty() ? open.size() : quotes.front());
+            }
+            return;
+        }
+
+        // Match the line against the open containers, outermost first
+        size_t p = 0;
+        size_t matched = 1;
+        for (; matched < open.size(); matched++) {
+            BlockNode* node = open[matched];
+            if (node->kind == BLOCK_QUOTE) {
+                size_t q = skipIndent(line, p);
+                if (q >= line.size() || line[q] != '>') {
+                    break;
+                }
+                p = q + 1 + (q + 1 < line.size() && line[q + 1] == ' ');
+            } else if (node->kind == BLOCK_ITEM) {
+                size_t q = p;
+                while (q < p + node->indent && q < line.size() && line[q] == ' ') {
+                    q++;
+                }
+                if (q < p + node->indent) {
+                    break;
+                }
+                p = q;
+            }
+        }
+
+        // Code block lines hold no containers
+        if (in_fence && matched == open.size()) {
+            leaf_lines.push_back(line.substr(p));
+            in_fence = line.compare(p, 3, "```") != 0;
+            return;
+        }
+
+        // A list only continues with another item
+        bool marker = isItemMarker(line, skipIndent(line, p));
+        if (open[matched - 1]->kind == BLOCK_LIST && !marker) {
+            matched--;
+        }
+        if (matched < open.size()) {
+            closeTo(matched);
+        }
+
+        // Open whatever containers start here
+        while (true) {
+            size_t q = skipIndent(line, p);
+            if (q < line.size() && line[q] == '>') {
+                closeLeaf();
+                push(BLOCK_QUOTE);
+                p = q + 1 + (q + 1 < line.size() && line[q + 1] == ' ');
+            } else if (isItemMarker(line, q)) {
+                closeLeaf();
+                if (open.back()->kind != BLOCK_LIST) {
+                    push(BLOCK_LIST);
+                }
+                push(BLOCK_ITEM);
+                open.back()->indent = q - p + 2;
+                p = q + 2;
+            } else {
+                break;
+            }
+        }
+
+        leaf_lines.push_back(line.substr(p));
+        in_fence = line.compare(p, 3, "```") == 0;
+    }
+
+public:
+    BlockTree(std::string_view markdown, Arena& arena) : arena(arena) {
+        markdown = markdown.substr(0, markdown.find('\0'));
+        root = new (arena.allocate(sizeof(BlockNode), alignof(BlockNode))) BlockNode(BLOCK_DOCUMENT);
+        open.push_back(root);
+
+        size_t start = 0;
+        while (start < markdown.size()) {
+            size_t end = std::min(markdown.find('\n', start), markdown.size());
+            addLine(markdown.substr(start, end - start));
+            start = end + 1;
+        }
+        closeTo(1);
+    }
+
+    BlockTree(const BlockTree&) = delete;
+    BlockTree& operator=(const BlockTree&) = delete;
+
+    const BlockNode* getRoot() const {
+        return root;
+    }
+
+    // Walks the tree depth first through the node links, writing each
+    // container's tags around its children and lexing each leaf on its own.
+    // Flushes the sink when done.
+    void render(OutputSink& sink, ParseStats* stats = nullptr) const {
+        std::string& output = sink.buffer();
+        auto write = [&](std::string_view tag) {
+            output += tag;
+            if constexpr (metrics_enabled) {
+                if (stats != nullptr) {
+                    stats->bytes_out += tag.size();
+                }
+            }
+        };
+
+        const BlockNode* node = root->first_child;
+        while (node != nullptr) {
+            switch (node->kind) {
+                case BLOCK_QUOTE: write("<blockquote>\n"); break;
+                case BLOCK_LIST: write("<ul>\n"); break;
+                case BLOCK_ITEM: write("<li>"); break;
+                case BLOCK_LEAF: {
+                    RenderState state;
+                    state.tight = node->parent->kind == BLOCK_ITEM && !node->parent->loose;
+                    HtmlRenderer renderer(sink, state, stats);
+                    Lexer lexer(node->content, &arena);
+                    Token token = lexer.get_next_token();
+                    while (!token.isEOF()) {
+                        renderer.render(token);
+                        token = lexer.get_next_token();
+                    }
+                    renderer.finish();
+                    break;
+                }
+                default: break;
+            }
+            if (node->first_child != nullptr) {
+                node = node->first_child;
+                continue;
+            }
+
+            // Close this node and every ancestor it was the last child of
+            while (node != root) {
+                switch (node->kind) {
+                    case BLOCK_QUOTE: write("</blockquote>\n"); break;
+                    case BLOCK_LIST: write("</ul>\n"); break;
+                    case BLOCK_ITEM: write("</li>\n"); break;
+                    default: break;
+                }
+                sink.commit();
+                if (node->next != nullptr) {
+                    break;
+                }
+                node = node->parent;
+            }
+            node = node == root ? nullptr : node->next;
+        }
+        sink.flush();
+    }
+};
+
+/********************
+*      Parser       *
+*********************/
+
+struct ParserOptions {
+    // Render each token as it is lexed instead of collecting them all first. Saves
+    // the token vector and a second pass over it; the output is identical.
+    bool fused = false;
+
+    // Lex inputs of at least parallel_min_bytes on this many threads, split at
+    // block boundaries. The tokens and HTML are identical to a serial run. Needs
+    // the token vector, so it takes precedence over `fused` for those inputs.
+    size_t lex_threads = 1;
+    size_t parallel_min_bytes = 1 << 20;
+
+    // Serve repeated inputs from this cache without lexing, and add misses to it.
+    // Not owned; may be shared between parsers, also ones with a different
+    // `block_tree`, which is part of the key.
+    RenderCache* cache = nullptr;
+
+    // Remember each block's source and HTML, keyed by the hash of its source and
+    // the RenderState it starts in, and reuse the HTML on the next parse for the
+    // same bytes so only changed blocks are lexed. Blocks the latest parse did not
+    // use are forgotten. A re-parse still hashes and copies the whole document,
+    // so it pays off on markup-heavy text (4-6x faster for lists and links on the
+    // bench) but is no faster than a plain parse for long plain paragraphs.
+    bool memoize_blocks = false;
+
+    // Nest lists by indentation and support > blockquotes by building a
+    // BlockTree first and lexing each of its leaves on its own. Takes precedence
+    // over the options above.
+    bool block_tree = false;
+
+    // Collect the document's headings while lexing, for outline() and writeToc(),
+    // and render each heading with its anchor as id. Cached blocks and documents
+    // are not lexed, so `cache` and `memoize_blocks` are not used while this is
+    // set. The outline stays empty with `block_tree`.
+    bool outline = false;
+};
+
+// Token storage and out-of-line token values come from a per-parser arena that is
+// rewound at the start of every parse, so a parser reused across documents stops
+// allocating once it has seen its largest one.
+class Parser {
+private:
+    ParserOptions options;
+    Arena arena;
+    std::optional<Lexer> lexer;
+    std::pmr::vector<Token> tokens{&arena};
+    std::vector<std::unique_ptr<Arena>> piece_arenas;   // one per parallel lexing piece
+    std::vector<Outline> piece_outlines;
+    Outline headings;
+    BufferSink html;    // output captured for the cache on a miss
+
+    struct MemoKey {
+        ContentHash hash;
+        RenderState state;
+
+        bool operator==(const MemoKey& other) const {
+            return hash == other.hash && state == other.state;
+        }
+    };
+    struct MemoKeyHasher {
+        size_t operator()(const MemoKey& key) const {
+            return static_cast<size_t>(key.hash.low) ^ (size_t(key.state.tight) << 2) ^ (size_t(key.state.inList) << 1) ^
+                   size_t(key.state.inParagraph);
+        }
+    };
+    struct MemoBlock {
+        MemoKey key;
+        size_t source_offset;   // in memo_source
+        size_t html_offset;     // in memo_html
+        size_t html_length;
+        RenderState state_out;
+    };
+    std::vector<MemoBlock> memo_blocks;         // the previous parse's blocks in order
+    std::vector<MemoBlock> next_memo_blocks;    // the current one's
+    std::string memo_source;                    // the previous parse's markdown
+    std::string memo_html;                      // their HTML, back to back
+    BufferSink block_html;                      // the current parse's HTML, back to back
+    std::unordered_map<MemoKey, size_t, MemoKeyHasher> memo_index;   // into memo_blocks
+    ParseStats metrics;
+    
+public:
+    Parser() = default;
+    explicit Parser(const ParserOptions& options) : options(options) {}
+    
+    std::string parse(const std::string& markdown) {
+        BufferSink sink;
+        parse(markdown, sink);
+        return sink.take();
+    }
+
+    // Renders straight into `sink` and flushes it before returning
+    void parse(std::string_view markdown, OutputSink& sink) {
+        uint64_t started = metrics_clock();
+        headings.clear();
+        if (options.cache != nullptr && !options.outline) {
+            ContentHash key = cacheKey(markdown);
+            size_t output_before = sink.buffer().size();
+            if (options.cache->lookup(key, markdown, sink)) {
+                if constexpr (metrics_enabled) {
+                    metrics.bytes_out += sink.buffer().size() - output_before;
+                }
+            } else {
+                render(markdown, html);
+                options.cache->insert(key, markdown, html.str());
+                sink.buffer().append(html.str());
+                html.buffer().clear();
+            }
+        } else {
+            render(markdown, sink);
+        }
+        sink.flush();
+        if constexpr (metrics_enabled) {
+            metrics.parses++;
+            metrics.bytes_in += markdown.size();
+            metrics_lap(metrics.parse_ns, started);
+        }
+    }
+
+    // Counters for every parse so far; all zero unless built with NOTEDOWN_METRICS
+    const ParseStats& stats() const {
+        return metrics;
+    }
+
+    void resetStats() {
+        metrics = ParseStats();
+    }
+
+    // Headings of the last parse, with ParserOptions::outline set. Their text is a
+    // span of that parse's input.
+    const Outline& outline() const {
+        return headings;
+    }
+    
+private:
+    // The content hash, changed for options that change the HTML so parsers
+    // sharing a cache never serve each other's output
+    ContentHash cacheKey(std::string_view markdown) const {
+        ContentHash key = hash_content(markdown);
+        if (options.block_tree) {
+            key.low = hash_mix(key.low ^ 0x626c6f636b747265ull, 0x9e3779b97f4a7c15ull);
+            key.high = hash_mix(key.high ^ 0x9e3779b97f4a7c15ull, 0x626c6f636b747265ull);
+        }
+        return key;
+    }
+
+    void render(std::string_view markdown, OutputSink& sink) {
+        // Drop the previous document's tokens before their storage is reused
+        lexer.reset();
+        std::pmr::vector<Token>(&arena).swap(tokens);
+        arena.reset();
+
+        lexer.emplace(markdown, &arena);
+        if (options.outline) {
+            lexer->collect_outline(&headings);
+        }
+
+        if (options.block_tree) {
+            uint64_t started = metrics_clock();
+            BlockTree tree(markdown, arena);
+            started = metrics_lap(metrics.lex_ns, started);
+            tree.render(sink, &metrics);
+            metrics_lap(metrics.render_ns, started);
+        } else if (options.memoize_blocks && !options.outline) {
+            renderBlocks(markdown, sink);
+        } else if (options.fused && (options.lex_threads <= 1 || markdown.size() < options.parallel_min_bytes)) {
+            lexAndRender(sink);
+        } else {
+            uint64_t started = metrics_clock();
+            if (options.lex_threads > 1 && markdown.size() >= options.parallel_min_bytes) {
+                lexParallel(markdown);
+            } else {
+                lexAll(markdown.size());
+            }
+            started = metrics_lap(metrics.lex_ns, started);
+            tokensToHtml(sink);
+            metrics_lap(metrics.render_ns, started);
+            if constexpr (metrics_enabled) {
+                metrics.peak_tokens = std::max<uint64_t>(metrics.peak_tokens, tokens.size());
+            }
+        }
+    }
+
+    void lexAll(size_t input_size) {        
+        tokens.reserve(input_size / 8 + 16);
+        Token token = lexer->get_next_token();
+        while (!token.isEOF()) {
+            tokens.push_back(token);
+            token = lexer->get_next_token();
+        }
+    }
+
+    // Splits the input at the block boundaries nearest to equal intervals and lexes
+    // the pieces concurrently, each with its own arena. Tokens are views into the
+    // shared input, so appending the pieces' tokens in order reproduces the serial
+    // token stream.
+    void lexParallel(std::string_view markdown) {
+        // The serial lexer stops at the first NUL, so the pieces must too
+        markdown = markdown.substr(0, markdown.find('\0'));
+
+        // A blank line is only a boundary outside code blocks, so the scan jumps
+        // ahead to the target only when no fence lies in between
+        std::vector<size_t> cuts{0};
+        BlockScanner scanner;
+        for (size_t i = 1; i < options.lex_threads; i++) {
+            size_t target = std::max(cuts.back(), markdown.size() / options.lex_threads * i);
+            size_t boundary;
+            do {
+                if (scanner.fence == std::string_view::npos &&
+                    find_fence(markdown, scanner.pos, target) == std::string_view::npos) {
+                    scanner.pos = std::max(scanner.pos, target);
+                }
+                boundary = scanner.next(markdown);
+            } while (boundary != std::string_view::npos && boundary < target);
+            if (boundary == std::string_view::npos || boundary >= markdown.size()) {
+                break;
+            }
+            if (boundary > cuts.back()) {
+                cuts.push_back(boundary);
+            }
+        }
+        cuts.push_back(markdown.size());
+
+        size_t pieces = cuts.size() - 1;
+        while (piece_arenas.size() < pieces) {
+            piece_arenas.push_back(std::make_unique<Arena>());
+        }
+
+        if (options.outline && piece_outlines.size() < pieces) {
+            piece_outlines.resize(pieces);
+        }
+
+        std::vector<std::pmr::vector<Token>> piece_tokens;
+        for (size_t i = 0; i < pieces; i++) {
+            piece_arenas[i]->reset();
+            piece_tokens.emplace_back(piece_arenas[i].get());
+        }
+
+        auto lexPiece = [&](size_t i) {
+            std::string_view piece = markdown.substr(cuts[i], cuts[i + 1] - cuts[i]);
+            Lexer piece_lexer(piece, piece_arenas[i].get());
+            if (options.outline) {
+                piece_outlines[i].clear();
+                piece_lexer.collect_outline(&piece_outlines[i]);
+            }
+            piece_tokens[i].reserve(piece.size() / 8 + 16);
+            Token token = piece_lexer.get_next_token();
+            while (!token.isEOF()) {
+                piece_tokens[i].push_back(token);
+                token = piece_lexer.get_next_token();
+            }
+        };
+
+        std::vector<std::thread> threads;
+        for (size_t i = 1; i < pieces; i++) {
+            threads.emplace_back(lexPiece, i);
+        }
+        lexPiece(0);
+        for (std::thread& thread : threads) {
+            thread.join();
+        }
+
+        size_t total = 0;
+        for (const auto& piece : piece_tokens) {
+            total += piece.size();
+        }
+        tokens.reserve(total);
+        for (const auto& piece : piece_tokens) {
+            tokens.insert(tokens.end(), piece.begin(), piece.end());
+        }
+        if (options.outline) {
+            for (size_t i = 0; i < pieces; i++) {
+                headings.append(piece_outlines[i], cuts[i]);
+            }
+        }
+    }
+
+    // Renders block by block, taking each block's HTML from the memo when the
+    // same source was rendered from the same state last time. The hash only picks
+    // the candidate; its source is compared with the block's before its HTML is
+    // reused, so a hash collision is rendered like an edit. Unchanged blocks
+    // come in the same order as last time, so each block is compared with the
+    // one after the previous block. A block that is not there is taken as
+    // edited; only when the block after it does not line up either are blocks
+    // looked up in an index, built then. All HTML is kept in one buffer, so
+    // reusing a block is a copy and never an allocation.
+    void renderBlocks(std::string_view markdown, OutputSink& sink) {
+        markdown = markdown.substr(0, markdown.find('\0'));
+
+        std::string& html = block_html.buffer();
+        RenderState state;
+        BlockScanner scanner;
+        size_t cursor = 0;
+        bool indexed = false;
+        bool missed = false;
+        size_t start = 0;
+        while (start < markdown.size()) {
+            size_t end = scanner.next(markdown);
+            if (end == std::string_view::npos) {
+                end = markdown.size();
+            }
+            std::string_view source = markdown.substr(start, end - start);
+            start = end;
+
+            MemoKey key{hash_content(source), state};
+            auto matches = [&](const MemoBlock& block) {
+                return block.key == key &&
+                       std::string_view(memo_source).substr(block.source_offset, source.size()) == source;
+            };
+            const MemoBlock* found = nullptr;
+            if (cursor < memo_blocks.size() && matches(memo_blocks[cursor])) {
+                found = &memo_blocks[cursor++];
+            } else if (!missed) {
+                cursor++;
+            } else {
+                if (!indexed) {
+                    memo_index.clear();
+                    for (size_t i = 0; i < memo_blocks.size(); i++) {
+                        memo_index.try_emplace(memo_blocks[i].key, i);
+                    }
+                    indexed = true;
+                }
+                auto hit = memo_index.find(key);
+                if (hit != memo_index.end() && matches(memo_blocks[hit->second])) {
+                    found = &memo_blocks[hit->second];
+                    cursor = hit->second + 1;
+                } else {
+                    cursor++;
+                }
+            }
+            missed = found == nullptr;
+
+            size_t html_offset = html.size();
+            if (found != nullptr) {
+                html.append(memo_html, found->html_offset, found->html_length);
+                state = found->state_out;
+                if constexpr (metrics_enabled) {
+                    metrics.bytes_out += found->html_length;
+                }
+            } else {
+                arena.reset();
+                Lexer block_lexer(source, &arena);
+                HtmlRenderer renderer(block_html, state, &metrics);
+                lexAndRender(block_lexer, renderer);
+                state = renderer.getState();
+            }
+            next_memo_blocks.push_back(
+                MemoBlock{key, size_t(source.data() - markdown.data()), html_offset, html.size() - html_offset, state});
+        }
+
+        sink.buffer() += html;
+        sink.commit();
+        HtmlRenderer(sink, state, &metrics).finish();
+
+        memo_source.assign(markdown);
+        memo_html.swap(html);
+        html.clear();
+        memo_blocks.swap(next_memo_blocks);
+        next_memo_blocks.clear();
+    }
+
+    void tokensToHtml(OutputSink& sink) {
+        HtmlRenderer renderer(sink, RenderState(), &metrics);
+        if (options.outline) {
+            renderer.setOutline(&headings);
+        }
+        for (const Token& token : tokens) {
+            renderer.render(token);
+        }
+        renderer.finish();
+    }
+
+    void lexAndRender(OutputSink& sink) {
+        HtmlRenderer renderer(sink, RenderState(), &metrics);
+        if (options.outline) {
+            renderer.setOutline(&headings);
+        }
+        lexAndRender(*lexer, renderer);
+        renderer.finish();
+    }
+
+    // Lex and render time alternate token by token here, so each phase switch
+    // reads the clock once
+    void lexAndRender(Lexer& source, HtmlRenderer& renderer) {
+        uint64_t mark = metrics_clock();
+        Token token = source.get_next_token();
+        while (!token.isEOF()) {
+            mark = metrics_lap(metrics.lex_ns, mark);
+            renderer.render(token);
+            mark = metrics_lap(metrics.render_ns, mark);
+            token = source.get_next_token();
+        }
+        metrics_lap(metrics.lex_ns, mark);
+    }
+};
+
+/********************
+*  Stream Parser    *
+*********************/
+
+// Push parser for input that arrives in pieces. Input is buffered only up to the
+// last block boundary; everything before it is lexed, rendered and flushed to the
+// sink straight away, so memory stays bounded by the largest block rather than
+// the document.
+class StreamParser {
+private:
+    OutputSink& sink;
+    ParseStats metrics;
+    HtmlRenderer renderer;
+    Arena arena;
+    std::string pending;
+    BlockScanner scanner;   // resumes where the last chunk's scan stopped
+    bool ended = false;     // a NUL byte ends the document, as it does for Lexer
+
+    void lex(std::string_view text) {
+        Lexer lexer(text, &arena);
+        uint64_t mark = metrics_clock();
+        Token token = lexer.get_next_token();
+        while (!token.isEOF()) {
+            mark = metrics_lap(metrics.lex_ns, mark);
+            renderer.render(token);
+            mark = metrics_lap(metrics.render_ns, mark);
+            token = lexer.get_next_token();
+        }
+        metrics_lap(metrics.lex_ns, mark);
+        arena.reset();
+    }
+
+public:
+    explicit StreamParser(OutputSink& sink) : sink(sink), renderer(sink, RenderState(), &metrics) {}
+
+    void feed(std::string_view chunk) {
+        if (ended) {
+            return;
+        }
+        size_t nul = chunk.find('\0');
+        if (nul != std::string_view::npos) {
+            chunk = chunk.substr(0, nul);
+            ended = true;
+        }
+        pending.append(chunk);
+        if constexpr (metrics_enabled) {
+            metrics.bytes_in += chunk.size();
+        }
+
+        size_t boundary = std::string::npos;
+        size_t next = scanner.next(pending);
+        while (next != std::string::npos) {
+            boundary = next;
+            next = scanner.next(pending);
+        }
+        if (boundary == std::string::npos) {
+            return;
+        }
+
+        lex(std::string_view(pending).substr(0, boundary));
+        pending.erase(0, boundary);
+        scanner.shift(boundary);
+        sink.flush();
+    }
+
+    // Flushes the remaining input and closes any open list or paragraph. The
+    // parser can be fed a new document afterwards.
+    void finish() {
+        lex(pending);
+        renderer.finish();
+        sink.flush();
+        pending.clear();
+        scanner = BlockScanner();
+        ended = false;
+        if constexpr (metrics_enabled) {
+            metrics.parses++;
+        }
+    }
+
+    // Counters for every document so far; all zero unless built with NOTEDOWN_METRICS
+    const ParseStats& stats() const {
+        return metrics;
+    }
+};
+
+
+/********************
+* Incremental Parser *
+*********************/
+
+// A change to a document's HTML: replace `removed_len` bytes at `offset` of the
+// previous output with `html`
+struct HtmlEdit {
+    size_t offset = 0;
+    size_t removed_len = 0;
+    std::string html;
+};
+
+// Keeps a document split into blocks at block boundaries, each with its own
+// source, tokens and rendered HTML, for editors that re-render after every
+// change. apply_edit() re-lexes only the blocks the edit touches and re-renders
+// the following blocks only while the RenderState they start from has changed,
+// so the cost of an edit follows its size rather than the document's. It
+// returns the change to the output, so a live preview can patch the HTML it
+// already has instead of copying html() after every edit.
+class IncrementalParser {
+private:
+    // Blocks form a treap ordered by position, in which every node also sums the
+    // source and HTML bytes of its subtree. Finding the block at an offset or the
+    // output offset of a block, and cutting a run of blocks out or splicing one
+    // in, are O(log n) for n blocks, so an edit costs the blocks it relexes and
+    // not the length of the document.
+    struct Block {
+        std::string source;         // ends just past its blank line, except for the last block
+        Arena arena{1024};          // out-of-line token values
+        std::vector<Token> tokens;  // views into source or arena
+        RenderState state_in;
+        RenderState state_out;
+        std::string html;
+        bool ends_document = false; // holds a NUL, where the lexer stops
+
+        std::unique_ptr<Block> left;
+        std::unique_ptr<Block> right;
+        uint64_t priority = 0;      // above both children's
+        size_t subtree_size = 0;
+        size_t subtree_html = 0;
+        bool subtree_ends = false;  // some block in the subtree ends_document
+    };
+    using BlockTreap = std::unique_ptr<Block>;
+
+    BlockTreap blocks;
+    size_t total_size = 0;
+    size_t output_size = 0;         // of html()
+    uint64_t priority_state = 0x9e3779b97f4a7c15ull;
+
+    static size_t bytes(const BlockTreap& tree) {
+        return tree ? tree->subtree_size : 0;
+    }
+
+    static size_t htmlBytes(const BlockTreap& tree) {
+        return tree ? tree->subtree_html : 0;
+    }
+
+    static bool endsDocument(const BlockTreap& tree) {
+        return tree && tree->subtree_ends;
+    }
+
+    static void update(Block& node) {
+        node.subtree_size = bytes(node.left) + node.source.size() + bytes(node.right);
+        node.subtree_html = htmlBytes(node.left) + node.html.size() + htmlBytes(node.right);
+        node.subtree_ends = endsDocument(node.left) || node.ends_document || endsDocument(node.right);
+    }
+
+    // Splits off the blocks that end at or before `offset`
+    static std::pair<BlockTreap, BlockTreap> split(BlockTreap tree, size_t offset) {
+        if (!tree) {
+            return {};
+        }
+        size_t node_end = bytes(tree->left) + tree->source.size();
+        if (node_end <= offset) {
+            auto [before, after] = split(std::move(tree->right), offset - node_end);
+            tree->right = std::move(before);
+            update(*tree);
+            return {std::move(tree), std::move(after)};
+        }
+        auto [before, after] = split(std::move(tree->left), offset);
+        tree->left = std::move(after);
+        update(*tree);
+        return {std::move(before), std::move(tree)};
+    }
+
+    static BlockTreap merge(BlockTreap before, BlockTreap after) {
+        if (!before || !after) {
+            return before ? std::move(before) : std::move(after);
+        }
+        if (before->priority > after->priority) {
+            before->right = merge(std::move(before->right), std::move(after));
+            update(*before);
+            return before;
+        }
+        after->left = merge(std::move(before), std::move(after->left));
+        update(*after);
+        return after;
+    }
+
+    static BlockTreap popFront(BlockTreap& tree) {
+        if (tree->left) {
+            BlockTreap first = popFront(tree->left);
+            update(*tree);
+            return first;
+        }
+        BlockTreap first = std::move(tree);
+        tree = std::move(first->right);
+        update(*first);
+        return first;
+    }
+
+    static BlockTreap popBack(BlockTreap& tree) {
+        if (tree->right) {
+            BlockTreap last = popBack(tree->right);
+            update(*tree);
+            return last;
+        }
+        BlockTreap last = std::move(tree);
+        tree = std::move(last->left);
+        update(*last);
+        return last;
+    }
+
+    static const Block* back(const BlockTreap& tree) {
+        const Block* node = tree.get();
+        while (node != nullptr && node->right) {
+            node = node->right.get();
+        }
+        return node;
+    }
+
+    static const Block* front(const BlockTreap& tree) {
+        const Block* node = tree.get();
+        while (node != nullptr && node->left) {
+            node = node->left.get();
+        }
+        return node;
+    }
+
+    // Calls `visit` on the blocks in order until it returns false
+    template <typename Visit>
+    static void forEach(Block* tree, Visit visit) {
+        std::vector<Block*> path;
+        Block* node = tree;
+        while (node != nullptr || !path.empty()) {
+            while (node != nullptr) {
+                path.push_back(node);
+                node = node->left.get();
+            }
+            node = path.back();
+            path.pop_back();
+            if (!visit(*node)) {
+                return;
+            }
+            node = node->right.get();
+        }
+    }
+
+    // Renders a block that is not in the tree
+    static void renderBlock(Block& block, const RenderState& state) {
+        BufferSink sink;
+        HtmlRenderer renderer(sink, state);
+        for (const Token& token : block.tokens) {
+            renderer.render(token);
+        }
+        block.state_in = state;
+        block.state_out = renderer.getState();
+        block.html = sink.take();
+        update(block);
+    }
+
+    // What closes the document after a last block that ends in `state`
+    static std::string finishHtml(const RenderState& state) {
+        BufferSink sink;
+        HtmlRenderer(sink, state).finish();
+        return sink.take();
+    }
+
+    BlockTreap lexBlock(std::string_view source) {
+        auto block = std::make_unique<Block>();
+        block->source = source;
+        block->ends_document = block->source.find('\0') != std::string::npos;
+        Lexer lexer(block->source, &block->arena);
+        Token token = lexer.get_next_token();
+        while (!token.isEOF()) {
+            block->tokens.push_back(token);
+            token = lexer.get_next_token();
+        }
+        priority_state += 0x9e3779b97f4a7c15ull;
+        block->priority = hash_mix(priority_state, 0xbf58476d1ce4e5b9ull);
+        update(*block);
+        return block;
+    }
+
+public:
+    explicit IncrementalParser(std::string_view markdown = std::string_view()) {
+        output_size = finishHtml(RenderState()).size();
+        apply_edit(0, 0, markdown);
+    }
+
+    // Replaces `removed_len` bytes at `offset` with `inserted_text`. Out-of-range
+    // offsets and lengths are clamped to the document. Returns the change to the
+    // output of html(): the re-rendered blocks' HTML in place of their old HTML.
+    // It reaches to the end of the output only when the blocks after the edit do
+    // not remain, or when the edit adds or removes the NUL that ends the document.
+    HtmlEdit apply_edit(size_t offset, size_t removed_len, std::string_view inserted_text) {
+        offset = std::min(offset, total_size);
+        removed_len = std::min(removed_len, total_size - offset);
+        size_t edit_end = offset + removed_len;
+
+        // The first block the edit touches. Text inserted right at the start of a
+        // block leaves the blank line ending the previous block intact, and an
+        // edit at the end of the document touches its last block.
+        auto [before, after] = split(std::move(blocks), offset);
+        if (!after && before) {
+            after = popBack(before);
+        }
+        size_t first_start = bytes(before);
+
+        // The old output of the blocks replaced or re-rendered, up to the block
+        // that ends the document
+        HtmlEdit change;
+        change.offset = htmlBytes(before);
+        bool old_ended = false;
+        auto retire = [&](const Block& block) {
+            if (!old_ended) {
+                change.removed_len += block.html.size();
+                old_ended = block.ends_document;
+            }
+        };
+
+        // The old blocks that cover the edit, taken off the front of `after`
+        std::string region;
+        size_t region_end = first_start;
+        while (after && (region_end == first_start || region_end < edit_end)) {
+            BlockTreap block = popFront(after);
+            retire(*block);
+            region_end += block->source.size();
+            region += block->source;
+        }
+        region.replace(offset - first_start, removed_len, inserted_text);
+
+        // Unless the edited text still ends at a boundary, outside any code block,
+        // it runs into the next block
+        std::vector<BlockTreap> relexed;
+        BlockScanner scanner;
+        size_t start = 0;
+        while (true) {
+            size_t end = scanner.next(region);
+            if (end == std::string::npos) {
+                if (after) {
+                    BlockTreap block = popFront(after);
+                    retire(*block);
+                    region += block->source;
+                    continue;
+                }
+                end = region.size();
+            }
+            if (end > start) {
+                relexed.push_back(lexBlock(std::string_view(region).substr(start, end - start)));
+            }
+            start = end;
+            if (start == region.size()) {
+                break;
+            }
+        }
+        total_size = total_size - removed_len + inserted_text.size();
+
+        const Block* previous = back(before);
+        RenderState state = previous != nullptr ? previous->state_out : RenderState();
+        bool new_ended = false;
+        auto place = [&](BlockTreap block, BlockTreap& middle) {
+            renderBlock(*block, state);
+            state = block->state_out;
+            if (!new_ended) {
+                change.html += block->html;
+                new_ended = block->ends_document;
+            }
+            middle = merge(std::move(middle), std::move(block));
+        };
+        BlockTreap middle;
+        for (BlockTreap& block : relexed) {
+            place(std::move(block), middle);
+        }
+        while (after && front(after)->state_in != state) {
+            BlockTreap block = popFront(after);
+            retire(*block);
+            place(std::move(block), middle);
+        }
+
+        // The rest of the output is unchanged when blocks follow that still end
+        // in the same state. Otherwise it is replaced through to the end, where
+        // the remaining blocks and the closing tags are output again.
+        if (endsDocument(before)) {
+            change = HtmlEdit{output_size, 0, std::string()};
+        } else if (old_ended || new_ended || !after) {
+            RenderState last = state;
+            if (new_ended) {
+                forEach(middle.get(), [&](const Block& block) {
+                    last = block.state_out;
+                    return !block.ends_document;
+                });
+            } else {
+                forEach(after.get(), [&](const Block& block) {
+                    change.html += block.html;
+                    last = block.state_out;
+                    return !block.ends_document;
+                });
+            }
+            change.html += finishHtml(last);
+            change.removed_len = output_size - change.offset;
+        }
+        output_size = output_size - change.removed_len + change.html.size();
+        blocks = merge(merge(std::move(before), std::move(middle)), std::move(after));
+        return change;
+    }
+
+    size_t size() const {
+        return total_size;
+    }
+
+    std::string text() const {
+        std::string result;
+        result.reserve(total_size);
+        forEach(blocks.get(), [&](const Block& block) {
+            result += block.source;
+            return true;
+        });
+        return result;
+    }
+
+    // Writes the HTML for the whole document and flushes the sink
+    void render(OutputSink& sink) const {
+        RenderState state;
+        forEach(blocks.get(), [&](const Block& block) {
+            sink.buffer() += block.html;
+            sink.commit();
+            state = block.state_out;
+            return !block.ends_document;
+        });
+        HtmlRenderer renderer(sink, state);
+        renderer.finish();
+        sink.flush();
+    }
+
+    std::string html() const {
+        BufferSink sink;
+        render(sink);
+        return sink.take();
+    }
+};
+
+/********************
+*    Token Files    *
+*********************/
+
+// A lexed document in a form other processes can memory-map and use in place:
+//
+//   TokenFileHeader | TokenRecord[token_count] | BlockRecord[block_count] | text
+//
+// The text area holds the source (cut at the first NUL, as the lexer does)
+// followed by any token values that are not spans of it. Records refer to the
+// text area by offset, so a token is rebuilt with two pointer additions and no
+// parsing. Blocks are the runs of tokens between block boundaries. Everything
+// is in native byte order and offsets are 32-bit, so a file is read on the
+// architecture that wrote it and holds at most 4 GB of text.
+struct TokenFileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t token_count;
+    uint32_t block_count;
+    uint32_t source_size;
+    uint32_t text_size;
+    uint32_t tokens_offset;
+    uint32_t blocks_offset;
+    uint32_t text_offset;
+    uint32_t reserved;
+};
+
+struct TokenRecord {
+    uint32_t type;
+    uint32_t value_offset;
+    uint32_t value_length;
+    uint32_t url_offset;
+    uint32_t url_length;
+};
+
+struct BlockRecord {
+    uint32_t source_offset;
+    uint32_t source_length;
+    uint32_t first_token;
+    uint32_t token_count;
+};
+
+constexpr char TOKEN_FILE_MAGIC[8] = {'N', 'D', 'T', 'O', 'K', 'E', 'N', 'S'};
+constexpr uint32_t TOKEN_FILE_VERSION = 1;
+constexpr uint32_t TOKEN_FILE_BYTE_ORDER = 0x01020304;
+
+// Lexes `markdown` block by block and writes it to `sink` in the token file
+// format. Returns false, writing nothing, if the text does not fit 32-bit offsets.
+bool writeTokenFile(std::string_view markdown, OutputSink& sink) {
+    markdown = markdown.substr(0, markdown.find('\0'));
+
+    Arena arena;
+    std::vector<TokenRecord> records;
+    std::vector<BlockRecord> blocks;
+    std::string extra;
+
+    // Spans of the source are stored by offset; anything else is appended
+    auto place = [&](std::string_view span, uint32_t& offset, uint32_t& length) {
+        length = static_cast<uint32_t>(span.size());
+        if (span.empty()) {
+            offset = 0;
+        } else if (span.data() >= markdown.data() && span.data() + span.size() <= markdown.data() + markdown.size()) {
+            offset = static_cast<uint32_t>(span.data() - markdown.data());
+        } else {
+            offset = static_cast<uint32_t>(markdown.size() + extra.size());
+            extra.append(span);
+        }
+    };
+
+    if (markdown.size() > UINT32_MAX) {
+        return false;
+    }
+    size_t start = 0;
+    while (start < markdown.size()) {
+        size_t end = next_block_boundary(markdown, start);
+        if (end == std::string_view::npos) {
+            end = markdown.size();
+        }
+        BlockRecord block{static_cast<uint32_t>(start), static_cast<uint32_t>(end - start),
+                          static_cast<uint32_t>(records.size()), 0};
+        Lexer lexer(markdown.substr(start, end - start), &arena);
+        Token token = lexer.get_next_token();
+        while (!token.isEOF()) {
+            TokenRecord record{static_cast<uint32_t>(token.getType()), 0, 0, 0, 0};
+            place(token.getValue(), record.value_offset, record.value_length);
+            place(token.getUrl(), record.url_offset, record.url_length);
+            records.push_back(record);
+            token = lexer.get_next_token();
+        }
+        block.token_count = static_cast<uint32_t>(records.size() - block.first_token);
+        blocks.push_back(block);
+        start = end;
+    }
+
+    size_t text_size = markdown.size() + extra.size();
+    if (text_size > UINT32_MAX || records.size() > UINT32_MAX / sizeof(TokenRecord)) {
+        return false;
+    }
+
+    TokenFileHeader header{};
+    std::copy(std::begin(TOKEN_FILE_MAGIC), std::end(TOKEN_FILE_MAGIC), header.magic);
+    header.version = TOKEN_FILE_VERSION;
+    header.byte_order = TOKEN_FILE_BYTE_ORDER;
+    header.token_count = static_cast<uint32_t>(records.size());
+    header.block_count = static_cast<uint32_t>(blocks.size());
+    header.source_size = static_cast<uint32_t>(markdown.size());
+    header.text_size = static_cast<uint32_t>(text_size);
+    header.tokens_offset = sizeof(TokenFileHeader);
+    header.blocks_offset = header.tokens_offset + header.token_count * sizeof(TokenRecord);
+    header.text_offset = header.blocks_offset + header.block_count * sizeof(BlockRecord);
+
+    std::string& out = sink.buffer();
+    out.append(reinterpret_cast<const char*>(&header), sizeof(header));
+    out.append(reinterpret_cast<const char*>(records.data()), records.size() * sizeof(TokenRecord));
+    out.append(reinterpret_cast<const char*>(blocks.data()), blocks.size() * sizeof(BlockRecord));
+    sink.commit();
+    out.append(markdown);
+    sink.commit();
+    out.append(extra);
+    sink.flush();
+    return true;
+}
+
+// Read-only view over token file bytes, typically a MappedFile. The header, the
+// table extents and every block record are checked up front, and the header is
+// copied, so later changes to the bytes cannot move the checked bounds. token()
+// and block() check their index and the record's spans, so a corrupt record
+// yields an empty TEXT token or block instead of reading out of bounds.
+class TokenFileView {
+private:
+    TokenFileHeader header{};
+    const TokenRecord* records = nullptr;
+    const BlockRecord* blocks = nullptr;
+    const char* text = nullptr;
+
+    std::string_view span(uint32_t offset, uint32_t length) const {
+        if (length == 0 || offset > header.text_size || length > header.text_size - offset) {
+            return std::string_view();
+        }
+        return std::string_view(text + offset, length);
+    }
+
+    static bool validBlock(const TokenFileHeader& header, const BlockRecord& block) {
+        return uint64_t(block.first_token) + block.token_count <= header.token_count &&
+               uint64_t(block.source_offset) + block.source_length <= header.source_size;
+    }
+
+public:
+    explicit TokenFileView(std::string_view bytes) {
+        if (bytes.size() < sizeof(TokenFileHeader) ||
+            reinterpret_cast<uintptr_t>(bytes.data()) % alignof(TokenFileHeader) != 0) {
+            return;
+        }
+        TokenFileHeader candidate;
+        std::memcpy(&candidate, bytes.data(), sizeof(candidate));
+        uint64_t tokens_end = uint64_t(candidate.tokens_offset) + uint64_t(candidate.token_count) * sizeof(TokenRecord);
+        uint64_t blocks_end = uint64_t(candidate.blocks_offset) + uint64_t(candidate.block_count) * sizeof(BlockRecord);
+        uint64_t text_end = uint64_t(candidate.text_offset) + candidate.text_size;
+        if (!std::equal(std::begin(TOKEN_FILE_MAGIC), std::end(TOKEN_FILE_MAGIC), candidate.magic) ||
+            candidate.version != TOKEN_FILE_VERSION ||
+            candidate.byte_order != TOKEN_FILE_BYTE_ORDER ||
+            candidate.source_size > candidate.text_size ||
+            candidate.tokens_offset % alignof(TokenRecord) != 0 || candidate.blocks_offset % alignof(BlockRecord) != 0 ||
+            tokens_end > bytes.size() || blocks_end > bytes.size() || text_end > bytes.size()) {
+            return;
+        }
+        auto candidate_blocks = reinterpret_cast<const BlockRecord*>(bytes.data() + candidate.blocks_offset);
+        for (size_t i = 0; i < candidate.block_count; i++) {
+            if (!validBlock(candidate, candidate_blocks[i])) {
+                return;
+            }
+        }
+        header = candidate;
+        records = reinterpret_cast<const TokenRecord*>(bytes.data() + header.tokens_offset);
+        blocks = candidate_blocks;
+        text = bytes.data() + header.text_offset;
+    }
+
+    bool good() const {
+        return text != nullptr;
+    }
+
+    size_t tokenCount() const {
+        return header.token_count;
+    }
+
+    size_t blockCount() const {
+        return header.block_count;
+    }
+
+    // The source the tokens were lexed from
+    std::string_view source() const {
+        return std::string_view(text, header.source_size);
+    }
+
+    Token token(size_t i) const {
+        if (i >= header.token_count) {
+            return Token(TEXT, std::string_view());
+        }
+        const TokenRecord record = records[i];
+        if (record.type >= TOKEN_TYPE_COUNT) {
+            return Token(TEXT, std::string_view());
+        }
+        return Token(static_cast<TokenType>(record.type), span(record.value_offset, record.value_length),
+                     span(record.url_offset, record.url_length));
+    }
+
+    // An empty block past the end or for a record that no longer checks out
+    BlockRecord block(size_t i) const {
+        if (i >= header.block_count) {
+            return BlockRecord{};
+        }
+        const BlockRecord record = blocks[i];
+        return validBlock(header, record) ? record : BlockRecord{};
+    }
+
+    // Renders the document without lexing and flushes the sink
+    void render(OutputSink& sink) const {
+        HtmlRenderer renderer(sink);
+        for (size_t i = 0; i < tokenCount(); i++) {
+            renderer.render(token(i));
+        }
+        renderer.finish();
+        sink.flush();
+    }
+};
+
+// Read-only memory map of a whole file
+class MappedFile {
+private:
+    void* data = MAP_FAILED;
+    size_t size = 0;
+
+public:
+    explicit MappedFile(const std::string& path) {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return;
+        }
+        struct stat info;
+        if (::fstat(fd, &info) == 0 && info.st_size > 0) {
+            size = static_cast<size_t>(info.st_size);
+            data = ::mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+        }
+        ::close(fd);
+    }
+
+    ~MappedFile() {
+        if (data != MAP_FAILED) {
+            ::munmap(data, size);
+        }
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    bool good() const {
+        return data != MAP_FAILED;
+    }
+
+    std::string_view bytes() const {
+        return good() ? std::string_view(static_cast<const char*>(data), size) : std::string_view();
+    }
+};
+
+/********************
+*    LEXER TESTS    *
+*********************/
+
+// Helper function to convert TokenType to string for debugging
+std::string tokenTypeToString(TokenType type) {
+    switch(type) {
+        case TEXT: return "TEXT";
+        case H1: return "H1";
+        case H2: return "H2";
+        case H3: return "H3";
+        case H4: return "H4";
+        case H5: return "H5";
+        case H6: return "H6";
+        case BOLD: return "BOLD";
+        case ITALIC: return "ITALIC";
+        case LINK: return "LINK";
+        case IMAGE: return "IMAGE";
+        case LIST: return "LIST";
+        case BOLD_OPEN: return "BOLD_OPEN";
+        case BOLD_CLOSE: return "BOLD_CLOSE";
+        case ITALIC_OPEN: return "ITALIC_OPEN";
+        case ITALIC_CLOSE: return "ITALIC_CLOSE";
+        case CODE_BLOCK: return "CODE_BLOCK";
+        case CODE: return "CODE";
+        default: return "UNKNOWN";
+    }
+}
+
+void runTests() {
+    struct ExpectedToken {
+        TokenType type;
+        std::string value;
+        std::string url = "";
+    };
+    struct TestCase {
+        std::string name;
+        std::string input;
+        std::vector<ExpectedToken> expected;
+    };
+
+    std::vector<TestCase> tests = {
+        {
+            "Basic Header Test",
+            "# Header 1\n",
+            {{H1, "Header 1"}}
+        },
+        {
+            "Multi-Level Header Test",
+            "## Header 2\n### Header 3\n###### Header 6",
+            {{H2, "Header 2"}, {H3, "Header 3"}, {H6, "Header 6"}}
+        },
+        {
+            "Basic Text Test",
+            "Plain text",
+            {{TEXT, "Plain text"}}
+        },
+        {
+            "Basic Bold Test",
+            "**bold**",
+            {{BOLD, "bold"}}
+        },
+        {
+            "Basic Italic Test",
+            "*italic*",
+            {{ITALIC, "italic"}}
+        },
+        {
+            "List Test",
+            "- Item 1\n- Item 2",
+            {{LIST, "Item 1"}, {LIST, "Item 2"}}
+        },
+        {
+            "Long Text Run Test",
+            "A long run of plain prose that spans several vector widths\nand a second line - item",
+            {{TEXT, "A long run of plain prose that spans several vector widths\nand a second line "}, {LIST, "item"}}
+        },
+        {
+            "Link Test",
+            "[OpenAI](https://openai.com)",
+            {{LINK, "OpenAI", "https://openai.com"}}
+        },
+        {
+            "Image Test",
+            "![Alt Text](image.png)",
+            {{IMAGE, "Alt Text", "image.png"}}
+        },
+        {
+            "Escaped Link Text Test",
+            "[a \\[b](c.png) [x",
+            {{LINK, "a [b", "c.png"}, {TEXT, " "}, {TEXT, "[x"}}
+        },
+        {
+            "Link Text With Pipe Test",
+            "[a|b](c|d)",
+            {{LINK, "a|b", "c|d"}}
+        },
+        {
+            "Unmatched Bracket Run Test",
+            std::string(10000, '[') + "x]",
+            {{TEXT, std::string(10000, '[') + "x]"}}
+        },
+        {
+            "Bold Inside Italic Test",
+            "*a **b** c*",
+            {{ITALIC_OPEN, ""}, {TEXT, "a "}, {BOLD, "b"}, {TEXT, " c"}, {ITALIC_CLOSE, ""}}
+        },
+        {
+            "Triple Star Test",
+            "***both***",
+            {{ITALIC_OPEN, ""}, {BOLD, "both"}, {ITALIC_CLOSE, ""}}
+        },
+        {
+            "Unclosed Stars Test",
+            "a * b ** c *d*",
+            {{TEXT, "a "}, {TEXT, "*"}, {TEXT, " b "}, {TEXT, "**"}, {TEXT, " c "}, {ITALIC, "d"}}
+        },
+        {
+            "Emphasis Per Line Test",
+            "*a\nb* **c",
+            {{TEXT, "*"}, {TEXT, "a\nb"}, {TEXT, "*"}, {TEXT, " "}, {TEXT, "**"}, {TEXT, "c"}}
+        },
+        {
+            "Fenced Code Test",
+            "```cpp \nint a = 1 < 2;\n\n*x* [y](z)\n```\nafter",
+            {{CODE_BLOCK, "int a = 1 < 2;\n\n*x* [y](z)\n", "cpp"}, {TEXT, "after"}}
+        },
+        {
+            "Unclosed Fence Test",
+            "text\n```\ncode\n\nmore",
+            {{TEXT, "text"}, {CODE_BLOCK, "code\n\nmore", ""}}
+        },
+        {
+            "Backticks Mid Line Test",
+            "a ``` b",
+            {{TEXT, "a "}, {TEXT, "```"}, {TEXT, " b"}}
+        },
+        {
+            "Code Span Test",
+            "`a*b*` `` x ` y `` `*`c",
+            {{CODE, "a*b*"}, {TEXT, " "}, {CODE, "x ` y"}, {TEXT, " "}, {CODE, "*"}, {TEXT, "c"}}
+        },
+        {
+            "Unmatched Backticks Test",
+            "``a` b\n\n`c",
+            {{TEXT, "``"}, {TEXT, "a"}, {TEXT, "`"}, {TEXT, " b"}, {TEXT, "`"}, {TEXT, "c"}}
+        },
+        {
+            "Code Span Inside Emphasis Test",
+            "*a `*` b* [x `]` y](u)",
+            {{ITALIC_OPEN, ""}, {TEXT, "a "}, {CODE, "*"}, {TEXT, " b"}, {ITALIC_CLOSE, ""}, {TEXT, " "},
+             {LINK, "x `]` y", "u"}}
+        },
+        {
+            "Unlinked Brackets Test",
+            "[a] [b](c [d",
+            {{TEXT, "[a]"}, {TEXT, " "}, {TEXT, "[b](c [d"}}
+        },
+        {
+            "Code Span In Link Url Test",
+            "*q [a](u`x) *b* `",
+            {{TEXT, "*"}, {TEXT, "q "}, {TEXT, "[a](u`x) *b* `"}}
+        },
+        {
+            "Closed Code Span In Link Url Test",
+            "[a](u`)`) *b*",
+            {{LINK, "a", "u`)`"}, {TEXT, " "}, {ITALIC, "b"}}
+        },
+    };
+
+    // Literal stars between code spans inside one emphasis, long enough that a
+    // rescan per span would take seconds
+    {
+        TestCase run{"Code Spans In Emphasis Run Test", "**a", {{BOLD_OPEN, ""}}};
+        for (int i = 0; i < 20000; i++) {
+            run.input += " * `x`";
+            run.expected.push_back({TEXT, i == 0 ? "a * " : " * "});
+            run.expected.push_back({CODE, "x"});
+        }
+        run.input += " b**";
+        run.expected.push_back({TEXT, " b"});
+        run.expected.push_back({BOLD_CLOSE, ""});
+        tests.push_back(std::move(run));
+    }
+
+    for (const auto& test : tests) {
+        std::cout << "\nRunning test: " << test.name << std::endl;
+        
+        Lexer lexer(test.input);
+        std::vector<Token> tokens;
+        Token token = lexer.get_next_token();
+        
+        while (!token.isEOF()) {
+            tokens.push_back(token);
+            token = lexer.get_next_token();
+        }
+
+        bool passed = tokens.size() == test.expected.size();
+        for (size_t i = 0; i < tokens.size() && passed; ++i) {
+            if (tokens[i].getType() != test.expected[i].type || tokens[i].getValue() != test.expected[i].value ||
+                tokens[i].getUrl() != test.expected[i].url) {
+                passed = false;
+                std::cout << "Mismatch in token " << i 
+                          << ": Expected (" << tokenTypeToString(test.expected[i].type) << ", \"" << test.expected[i].value
+                          << "\", \"" << test.expected[i].url << "\") "
+                          << "but got (" << tokenTypeToString(tokens[i].getType()) << ", \"" << tokens[i].getValue()
+                          << "\", \"" << tokens[i].getUrl() << "\")\n";
+            }
+        }
+
+        if (passed) {
+            std::cout << "Test passed!" << std::endl;
+        } else {
+            std::cout << "Test failed!" << std::endl;
+            std::cout << "Expected tokens:\n";
+            for (const auto& expected : test.expected) {
+                std::cout << "  (" << tokenTypeToString(expected.type) << ", \"" << expected.value
+                          << "\", \"" << expected.url << "\")\n";
+            }
+            std::cout << "Actual tokens:\n";
+            for (const auto& actual : tokens) {
+                std::cout << "  (" << tokenTypeToString(actual.getType()) << ", \"" << actual.getValue()
+                          << "\", \"" << actual.getUrl() << "\")\n";
+            }
+        }
+    }
+
+    std::cout << "\nAll tests completed successfully!" << std::endl;
+}
+
+void runParserTests() {
+    struct TestCase {
+        std::string name;
+        std::string input;
+        std::string expected_html;
+    };
 
     std::vector<TestCase> tests = {
         {
             "Basic Header Test",
-            "# Header 1\n",
-            {{H1, "Header 1"}}
+            "# Header 1",
+            "<h1>Header 1</h1>\n"
         },
         {
-            "Multi-Level Header Test",
-            "## Header 2\n### Header 3\n###### Header 6",
-            {{H2, "Header 2"}, {H3, "Header 3"}, {H6, "Header 6"}}
+            "Multiple Headers Test",
+            "## Header 2\n### Header 3",
+            "<h2>Header 2</h2>\n<h3>Header 3</h3>\n"
         },
         {
-            "Basic Text Test",
-            "Plain text",
-            {{TEXT, "Plain text"}}
+            "Text and Bold Test",
+            "This is **bold** text.",
+            "<p>This is <strong>bold</strong> text.</p>\n"
         },
         {
-            "Basic Bold Test",
-            "**bold**",
-            {{BOLD, "bold"}}
+            "Italic Text Test",
+            "This is *italic* text.",
+            "<p>This is <em>italic</em> text.</p>\n"
         },
         {
-            "Basic Italic Test",
-            "*italic*",
-            {{ITALIC, "italic"}}
+            "Link Test",
+            "This is a [link](http://example.com).",
+            "<p>This is a <a href=\"http://example.com\">link</a>.</p>\n"
+        },
+        {
+            "Image Test",
+            "This is an image ![Alt text](image.png).",
+            "<p>This is an image <img src=\"image.png\" alt=\"Alt text\">.</p>\n"
         },
         {
             "List Test",
             "- Item 1\n- Item 2",
-            {{LIST, "Item 1"}, {LIST, "Item 2"}}
+            "<ul>\n<li>Item 1</li>\n<li>Item 2</li>\n</ul>\n"
         },
         {
-            "Link Test",
-            "[OpenAI](https://openai.com)",
-            {{LINK, "OpenAI|https://openai.com"}}
+            "Complex Mixed Content",
+            "# Title\nSome **bold** and *italic* text with a [link](http://example.com).\n- List item 1\n- List item 2",
+            "<h1>Title</h1>\n<p>Some <strong>bold</strong> and <em>italic</em> text with a <a href=\"http://example.com\">link</a>.</p>\n<ul>\n<li>List item 1</li>\n<li>List item 2</li>\n</ul>\n"
         },
         {
-            "Image Test",
-            "![Alt Text](image.png)",
-            {{IMAGE, "Alt Text|image.png"}}
+            "HTML Escaping Test",
+            "Use <b> & \"quotes\" in a sentence long enough to span vector widths <i>",
+            "<p>Use &lt;b&gt; &amp; &quot;quotes&quot; in a sentence long enough to span vector widths &lt;i&gt;</p>\n"
+        },
+        {
+            "Escaped Link Text Test",
+            "[a\\[b](u) ![c\\[d](e.png) [f\\[g",
+            "<p><a href=\"u\">a[b</a> <img src=\"e.png\" alt=\"c[d\"> [f[g</p>\n"
+        },
+        {
+            "Link Text With Pipe Test",
+            "See [a | b](x.html) and ![c|d](e.png)",
+            "<p>See <a href=\"x.html\">a | b</a> and <img src=\"e.png\" alt=\"c|d\"></p>\n"
+        },
+        {
+            "Nested Emphasis Test",
+            "**bold *and italic* & more** then *x **y***",
+            "<p><strong>bold <em>and italic</em> &amp; more</strong> then <em>x <strong>y</strong></em></p>\n"
+        },
+        {
+            "Fenced Code Block Test",
+            "Intro\n```js\nif (a < b && c) {\n\n  x = \"**\";\n}\n```\n\n- item",
+            "<p>Intro</p>\n<pre><code class=\"language-js\">if (a &lt; b &amp;&amp; c) {\n\n  x = &quot;**&quot;;\n}\n</code></pre>\n<ul>\n<li>item</li>\n</ul>\n"
+        },
+        {
+            "Link Stops At Fence Test",
+            "[a\n```\nb](u)\n\n```\n\nc\n\n```",
+            "<p>[a</p>\n<pre><code>b](u)\n\n</code></pre>\n<p>c</p>\n<pre><code></code></pre>\n"
+        },
+        {
+            "Nul On Closing Fence Test",
+            std::string("```\nx\n```\0\nafter", 16),
+            "<pre><code>x\n</code></pre>\n"
+        },
+        {
+            "Link Across Blank Line Test",
+            "- item\n\n[a\n\nb](u) [c\nd](e)",
+            "<ul>\n<li>item</li>\n</ul>\n<p>[ab](u) <a href=\"e\">c\nd</a></p>\n"
+        },
+        {
+            "Inline Code Test",
+            "Use `a < b` or ``*x* [y](z)`` in **`bold`**",
+            "<p>Use <code>a &lt; b</code> or <code>*x* [y](z)</code> in <strong><code>bold</code></strong></p>\n"
+        },
+        {
+            "Code Span In Link Url Test",
+            "*q [a](u`x) *b* `",
+            "<p>*q [a](u`x) *b* `</p>\n"
+        },
+        {
+            "Closed Code Span In Link Url Test",
+            "[a](u`)`) *b*",
+            "<p><a href=\"u`)`\">a</a> <em>b</em></p>\n"
+        },
+    };
+
+    Parser parser;
+    ParserOptions fused_options;
+    fused_options.fused = true;
+    Parser fused_parser(fused_options);
+    ParserOptions parallel_options;
+    parallel_options.lex_threads = 3;
+    parallel_options.parallel_min_bytes = 0;
+    Parser parallel_parser(parallel_options);
+    ParserOptions memo_options;
+    memo_options.memoize_blocks = true;
+    Parser memo_parser(memo_options);
+
+    for (const auto& test : tests) {
+        std::cout << "\nRunning test: " << test.name << std::endl;
+        
+        std::string actual_html = parser.parse(test.input);
+        std::string fused_html = fused_parser.parse(test.input);
+        std::string parallel_html = parallel_parser.parse(test.input);
+        std::string memo_html = memo_parser.parse(test.input);
+
+        BufferSink token_file;
+        writeTokenFile(test.input, token_file);
+        BufferSink cached_sink;
+        TokenFileView(token_file.str()).render(cached_sink);
+        std::string cached_html = cached_sink.take();
+
+        // The stream parser must produce the same HTML however the input is split
+        std::string streamed_html;
+        CallbackSink stream_sink([&](std::string_view html) { streamed_html += html; });
+        StreamParser stream(stream_sink);
+        for (size_t i = 0; i < test.input.size(); i += 3) {
+            stream.feed(std::string_view(test.input).substr(i, 3));
+        }
+        stream.finish();
+        
+        if (actual_html == test.expected_html && fused_html == test.expected_html &&
+            parallel_html == test.expected_html && streamed_html == test.expected_html &&
+            cached_html == test.expected_html && memo_html == test.expected_html) {
+            std::cout << "Test passed!" << std::endl;
+        } else {
+            std::cout << "Test failed!" << std::endl;
+            std::cout << "Expected:\n" << test.expected_html << std::endl;
+            std::cout << "Got:\n" << actual_html << std::endl;
+            std::cout << "Fused:\n" << fused_html << std::endl;
+            std::cout << "Parallel:\n" << parallel_html << std::endl;
+            std::cout << "From token file:\n" << cached_html << std::endl;
+            std::cout << "Memoized:\n" << memo_html << std::endl;
+            std::cout << "Streamed:\n" << streamed_html << std::endl;
+        }
+    }
+
+    {
+        std::cout << "\nRunning test: Corrupt Block Record Test" << std::endl;
+        BufferSink token_file;
+        writeTokenFile("a\n\nb\n", token_file);
+        std::string bytes = token_file.take();
+        bool passed = TokenFileView(bytes).good() && TokenFileView(bytes).blockCount() == 2 &&
+                      TokenFileView(bytes).token(TokenFileView(bytes).tokenCount()).getValue().empty();
+        TokenFileHeader header;
+        std::memcpy(&header, bytes.data(), sizeof(header));
+        BlockRecord block;
+        std::memcpy(&block, bytes.data() + header.blocks_offset + sizeof(BlockRecord), sizeof(block));
+        block.token_count = UINT32_MAX;
+        std::memcpy(bytes.data() + header.blocks_offset + sizeof(BlockRecord), &block, sizeof(block));
+        passed = passed && !TokenFileView(bytes).good();
+        std::cout << (passed ? "Test passed!" : "Test failed!") << std::endl;
+    }
+
+    {
+        std::cout << "\nRunning test: Rewritten Header Test" << std::endl;
+        BufferSink token_file;
+        writeTokenFile("a *b*\n\nc\n", token_file);
+        std::string bytes = token_file.take();
+        TokenFileView view(bytes);
+        BufferSink before;
+        view.render(before);
+        size_t tokens = view.tokenCount();
+
+        // A header rewritten after the view checked it must not widen its bounds
+        TokenFileHeader header;
+        std::memcpy(&header, bytes.data(), sizeof(header));
+        header.token_count = UINT32_MAX;
+        header.text_size = UINT32_MAX;
+        std::memcpy(bytes.data(), &header, sizeof(header));
+        BufferSink after;
+        view.render(after);
+        bool passed = view.good() && view.tokenCount() == tokens && after.str() == before.str() &&
+                      !TokenFileView(bytes).good();
+        std::cout << (passed ? "Test passed!" : "Test failed!") << std::endl;
+    }
+
+    std::cout << "\nAll parser tests completed!" << std::endl;
+}
+
+void runBlockTreeTests() {
+    struct TestCase {
+        std::string name;
+        std::string input;
+        std::string expected_html;
+    };
+
+    std::vector<TestCase> tests = {
+        {
+            "Flat List Block Test",
+            "# Title\n\n- a\n- b\n\nafter",
+            "<h1>Title</h1>\n<ul>\n<li>a</li>\n<li>b</li>\n</ul>\n<p>after</p>\n"
+        },
+        {
+            "Nested List Test",
+            "- a\n  - b *x*\n    - c\n  - d\n- e",
+            "<ul>\n<li>a<ul>\n<li>b <em>x</em><ul>\n<li>c</li>\n</ul>\n</li>\n<li>d</li>\n</ul>\n</li>\n<li>e</li>\n</ul>\n"
+        },
+        {
+            "Blockquote Test",
+            "> quoted **text** and\n> more\n\nplain",
+            "<blockquote>\n<p>quoted <strong>text</strong> and\nmore</p>\n</blockquote>\n<p>plain</p>\n"
+        },
+        {
+            "Quote In List Test",
+            "- item\n  > q1\n  > > q2\n- next",
+            "<ul>\n<li>item<blockquote>\n<p>q1</p>\n<blockquote>\n<p>q2</p>\n</blockquote>\n</blockquote>\n</li>\n<li>next</li>\n</ul>\n"
+        },
+        {
+            "List In Quote Test",
+            "> - a\n>   - b\n> - c",
+            "<blockquote>\n<ul>\n<li>a<ul>\n<li>b</li>\n</ul>\n</li>\n<li>c</li>\n</ul>\n</blockquote>\n"
+        },
+        {
+            "Code In Containers Test",
+            "- a\n  ```\n  x\n\n  - y\n  ```\n- b\n\n> ```\n> q\n\n> ```",
+            "<ul>\n<li>a<pre><code>x\n\n- y\n</code></pre>\n</li>\n<li>b</li>\n</ul>\n<blockquote>\n<pre><code>q</code></pre>\n</blockquote>\n<blockquote>\n<pre><code></code></pre>\n</blockquote>\n"
+        },
+        {
+            "Loose Item Test",
+            "- one\n\n  two\n- three",
+            "<ul>\n<li><p>one</p>\n<p>two</p>\n</li>\n<li>three</li>\n</ul>\n"
+        },
+    };
+
+    ParserOptions options;
+    options.block_tree = true;
+    Parser parser(options);
+
+    for (const auto& test : tests) {
+        std::cout << "\nRunning test: " << test.name << std::endl;
+        std::string html = parser.parse(test.input);
+        if (html == test.expected_html) {
+            std::cout << "Test passed!" << std::endl;
+        } else {
+            std::cout << "Test failed!" << std::endl;
+            std::cout << "Expected:\n" << test.expected_html << std::endl;
+            std::cout << "Got:\n" << html << std::endl;
+        }
+    }
+
+    // Far deeper than any recursive walk could go
+    std::cout << "\nRunning test: Deep Nesting Test" << std::endl;
+    const size_t depth = 200000;
+    std::string deep(depth, '>');
+    deep += " x\n";
+    for (size_t i = 0; i < depth; i++) {
+        deep += "- ";
+    }
+    deep += "y";
+    std::string html = parser.parse(deep);
+    std::string_view view(html);
+    bool passed = view.find("<blockquote>\n<blockquote>\n") == 0 &&
+                  view.find("<p>x</p>\n</blockquote>\n") != std::string_view::npos &&
+                  view.find("<li>y</li>\n</ul>\n</li>\n") != std::string_view::npos &&
+                  view.substr(view.size() - 6) == "</ul>\n";
+    std::cout << (passed ? "Test passed!" : "Test failed!") << std::endl;
+
+    std::cout << "\nAll block tree tests completed!" << std::endl;
+}
+
+// Two 32-byte documents with the same hash_content: bytes 8-15 and 24-31 zero
+// both multiplications of the first round, so bytes 0-7 and 16-23 are lost
+std::pair<std::string, std::string> collidingInputs() {
+    const std::string k2 = "\xe3\xc6\x88\x9c\xf0\x6a\xbc\x8e";
+    const std::string k0 = "\x2f\x64\xbd\x78\x64\x1d\x76\xa0";
+    return {"# Hello " + k2 + "world!!!" + k0, "<script>" + k2 + "alert(1)" + k0};
+}
+
+void runIncrementalTests() {
+    struct Edit {
+        size_t offset;
+        size_t removed_len;
+        std::string inserted_text;
+    };
+    struct TestCase {
+        std::string name;
+        std::string input;
+        std::vector<Edit> edits;
+    };
+
+    std::vector<TestCase> tests = {
+        {
+            "Edit Inside Paragraph Test",
+            "# Title\n\nSome *text* here.\n\n- a\n- b\n",
+            {{12, 4, "**bold**"}, {0, 0, "Intro\n\n"}}
+        },
+        {
+            "Merge And Split Blocks Test",
+            "First paragraph\n\nSecond paragraph\n\n- item\n\nLast",
+            {{15, 2, " "}, {16, 0, "\n\n- "}, {0, 100, "gone"}}
+        },
+        {
+            "List State Propagation Test",
+            "- one\n\n- two\n\n- three\n\nend",
+            {{7, 0, "text\n\n"}, {7, 6, ""}, {0, 1, "#"}}
+        },
+        {
+            "Fence Open And Close Test",
+            "a\n\n```\nb\n\nc\n```\n\nd\n\ne",
+            {{3, 3, ""}, {0, 0, "```\n"}, {100, 0, "\n```\n\nf"}, {0, 4, ""}}
+        },
+        {
+            "Link Across Edit Test",
+            "[a](u)\n\n[b\n\n](v)",
+            {{10, 2, ""}, {0, 0, "!"}, {100, 0, "\n\n"}}
+        },
+        {
+            "Blocks Inserted And Moved Test",
+            "a\n\n- b\n\nc\n\nd",
+            {{0, 0, "x\n\n"}, {0, 3, ""}, {0, 0, "c\n\nc\n\n"}, {6, 3, ""}, {100, 0, "\n\na"}}
+        },
+        {
+            "Edits Around A NUL Test",
+            "a\n\n- b\n\nc\n\nd",
+            {{6, 0, std::string(1, '\0')}, {12, 0, "x"}, {0, 0, "# "}, {8, 1, ""}, {100, 0, std::string(1, '\0')}}
         },
     };
 
+    Parser parser;
+    ParserOptions memo_options;
+    memo_options.memoize_blocks = true;
+    Parser memo_parser(memo_options);
+
+    for (const auto& test : tests) {
+        std::cout << "\nRunning test: " << test.name << std::endl;
+
+        IncrementalParser document(test.input);
+        std::string text = test.input;
+        std::string preview = document.html();
+        bool passed = preview == parser.parse(text) && memo_parser.parse(text) == parser.parse(text);
+
+        for (const Edit& edit : test.edits) {
+            HtmlEdit change = document.apply_edit(edit.offset, edit.removed_len, edit.inserted_text);
+            preview.replace(change.offset, change.removed_len, change.html);
+            size_t offset = std::min(edit.offset, text.size());
+            text.replace(offset, std::min(edit.removed_len, text.size() - offset), edit.inserted_text);
+            if (document.text() != text || document.html() != parser.parse(text) || preview != document.html() ||
+                memo_parser.parse(text) != parser.parse(text)) {
+                passed = false;
+                std::cout << "Mismatch after editing to:\n" << text << std::endl;
+                std::cout << "Expected:\n" << parser.parse(text) << std::endl;
+                std::cout << "Got:\n" << document.html() << std::endl;
+            }
+        }
+
+        std::cout << (passed ? "Test passed!" : "Test failed!") << std::endl;
+    }
+
+    // Enough blocks and edits that a walk over the blocks per edit would take
+    // seconds
+    {
+        std::cout << "\nRunning test: Many Blocks Edit Test" << std::endl;
+        std::string text;
+        for (int i = 0; i < 200000; i++) {
+            text += i % 3 == 0 ? "- item\n\n" : "para\n\n";
+        }
+        IncrementalParser document(text);
+        std::string preview = document.html();
+        size_t patched = 0;
+        for (size_t i = 0; i < 5000; i++) {
+            size_t offset = i * 7919 % text.size();
+            const char* inserted = i % 2 == 0 ? "x" : "\n\n";
+            HtmlEdit change = document.apply_edit(offset, i % 3 == 0 ? 1 : 0, inserted);
+            preview.replace(change.offset, change.removed_len, change.html);
+            patched += change.removed_len + change.html.size();
+            text.replace(offset, i % 3 == 0 ? 1 : 0, inserted);
+        }
+        // The patches cover the edited blocks, not the rest of the document
+        bool passed = document.text() == text && document.html() == parser.parse(text) && preview == document.html() &&
+                      patched < 5000 * 200;
+        if (!passed) {
+            std::cout << "Patched " << patched << " bytes" << std::endl;
+        }
+        std::cout << (passed ? "Test passed!" : "Test failed!") << std::endl;
+    }
+
+    {
+        std::cout << "\nRunning test: Memoized Hash Collision Test" << std::endl;
+        auto [first, second] = collidingInputs();
+        Parser collision_parser(memo_options);
+        bool passed = collision_parser.parse(first) == parser.parse(first) &&
+                      collision_parser.parse(second) == parser.parse(second);
+        std::cout << (passed ? "Test passed!" : "Test failed!") << std::endl;
+    }
+
+    std::cout << "\nAll incremental tests completed!" << std::endl;
+}
+
+void runCacheTests() {
+    struct TestCase {
+        std::string name;
+        size_t budget;
+        std::vector<std::string> inputs;
+        uint64_t hits;
+        uint64_t misses;
+        uint64_t evictions;
+    };
+
+    // Each of "x1".."x3" renders to 10 bytes of HTML
+    const size_t entry = RenderCache::ENTRY_OVERHEAD + 2 + 10;
+    std::vector<TestCase> tests = {
+        {"Repeated Input Test", 1 << 20, {"# a", "*b*", "# a", "# a"}, 2, 2, 0},
+        {"LRU Eviction Test", 2 * entry, {"x1", "x2", "x1", "x3", "x1", "x2"}, 2, 4, 2},
+        {"Oversized Entry Test", entry - 1, {"x1", "x1"}, 0, 2, 0},
+    };
+
+    Parser parser;
+
+    for (const auto& test : tests) {
+        std::cout << "\nRunning test: " << test.name << std::endl;
+
+        RenderCache cache(test.budget);
+        ParserOptions options;
+        options.cache = &cache;
+        Parser cached_parser(options);
+
+        bool passed = true;
+        for (const std::string& input : test.inputs) {
+            if (cached_parser.parse(input) != parser.parse(input)) {
+                passed = false;
+                std::cout << "Wrong HTML for:\n" << input << std::endl;
+            }
+        }
+        RenderCacheStats stats = cache.stats();
+        if (stats.hits != test.hits || stats.misses != test.misses || stats.evictions != test.evictions ||
+            stats.bytes > test.budget) {
+            passed = false;
+            std::cout << "Got " << stats.hits << " hits, " << stats.misses << " misses, "
+                      << stats.evictions << " evictions, " << stats.bytes << " bytes" << std::endl;
+        }
+
+        std::cout << (passed ? "Test passed!" : "Test failed!") << std::endl;
+    }
+
+    {
+        std::cout << "\nRunning test: Shared Cache Block Tree Test" << std::endl;
+        RenderCache cache(1 << 20);
+        ParserOptions options;
+        options.cache = &cache;
+        ParserOptions tree_options = options;
+        tree_options.block_tree = true;
+        Parser cached_parser(options);
+        Parser tree_parser(tree_options);
+        ParserOptions plain_tree_options;
+        plain_tree_options.block_tree = true;
+        Parser plain_tree_parser(plain_tree_options);
+
+        const std::string input = "- a\n  - b\n> q\n";
+        bool passed = tree_parser.parse(input) == plain_tree_parser.parse(input) &&
+                      cached_parser.parse(input) == parser.parse(input) &&
+                      tree_parser.parse(input) == plain_tree_parser.parse(input) &&
+                      cached_parser.parse(input) == parser.parse(input) && cache.stats().hits == 2;
+        std::cout << (passed ? "Test passed!" : "Test failed!") << std::endl;
+    }
+
+    {
+        std::cout << "\nRunning test: Hash Collision Test" << std::endl;
+        auto [first, second] = collidingInputs();
+        RenderCache cache(1 << 20);
+        ParserOptions options;
+        options.cache = &cache;
+        Parser cached_parser(options);
+
+        bool passed = hash_content(first) == hash_content(second) &&
+                      cached_parser.parse(first) == parser.parse(first) &&
+                      cached_parser.parse(second) == parser.parse(second) && cache.stats().hits == 0;
+        std::cout << (passed ? "Test passed!" : "Test failed!") << std::endl;
+    }
+
+    std::cout << "\nAll cache tests completed!" << std::endl;
+}
+
+void runMetricsTests() {
+    if constexpr (!metrics_enabled) {
+        std::cout << "\nMetrics not compiled in, skipping metrics tests" << std::endl;
+        return;
+    }
+
+    struct TestCase {
+        std::string name;
+        ParserOptions options;
+    };
+
+    ParserOptions fused_options;
+    fused_options.fused = true;
+    ParserOptions memo_options;
+    memo_options.memoize_blocks = true;
+    std::vector<TestCase> tests = {
+        {"Buffered Metrics Test", ParserOptions()},
+        {"Fused Metrics Test", fused_options},
+        {"Memoized Metrics Test", memo_options},
+    };
+
+    const std::string input = "# Title\n\nSome *text* & [a](u)\n\n- one\n- two\n";
+    const uint64_t expected_tokens[TOKEN_TYPE_COUNT] = {2, 1, 0, 0, 0, 0, 0, 0, 1, 1, 0, 2};
+
     for (const auto& test : tests) {
         std::cout << "\nRunning test: " << test.name << std::endl;
-        
-        Lexer lexer(test.input);
-        std::vector<Token> tokens;
-        Token token = lexer.get_next_token();
-        
-        while (!token.isEOF()) {
-            tokens.push_back(token);
-            token = lexer.get_next_token();
+
+        Parser parser(test.options);
+        std::string html = parser.parse(input);
+        const ParseStats& stats = parser.stats();
+
+        bool passed = stats.parses == 1 && stats.bytes_in == input.size() && stats.bytes_out == html.size() &&
+                      std::equal(std::begin(expected_tokens), std::end(expected_tokens), stats.tokens) &&
+                      stats.escape_ns <= stats.render_ns &&
+                      stats.peak_tokens == (test.options.fused || test.options.memoize_blocks ? 0 : 7);
+        if (!passed) {
+            std::cout << "Got " << stats.bytes_in << " bytes in, " << stats.bytes_out << " out, "
+                      << stats.peak_tokens << " peak tokens, counts";
+            for (uint64_t count : stats.tokens) {
+                std::cout << ' ' << count;
+            }
+            std::cout << std::endl;
         }
 
-        bool passed = tokens.size() == test.expected.size();
-        for (size_t i = 0; i < tokens.size() && passed; ++i) {
-            if (tokens[i].getType() != test.expected[i].first || tokens[i].getValue() != test.expected[i].second) {
-                passed = false;
-                std::cout << "Mismatch in token " << i 
-                          << ": Expected (" << tokenTypeToString(test.expected[i].first) << ", \"" << test.expected[i].second << "\") "
-                          << "but got (" << tokenTypeToString(tokens[i].getType()) << ", \"" << tokens[i].getValue() << "\")\n";
+        std::cout << (passed ? "Test passed!" : "Test failed!") << std::endl;
+    }
+
+    std::cout << "\nAll metrics tests completed!" << std::endl;
+}
+
+void runGeneratorTests() {
+    const std::string input = "# Links\n\nSee [a](u1), *b* and [c](u2).\n\n- [d](u3)\n- e\n";
+
+    {
+        std::cout << "\nRunning test: Generator Matches Lexer Test" << std::endl;
+        Lexer lexer(input);
+        bool passed = true;
+        size_t count = 0;
+        for (const Token& token : lex_tokens(input)) {
+            Token expected = lexer.get_next_token();
+            passed = passed && !expected.isEOF() && token.getType() == expected.getType() &&
+                     token.getValue() == expected.getValue() && token.getUrl() == expected.getUrl();
+            count++;
+        }
+        passed = passed && count > 0 && lexer.get_next_token().isEOF();
+        std::cout << (passed ? "Test passed!" : "Test failed!") << std::endl;
+    }
+
+    {
+        std::cout << "\nRunning test: Filter And Take Test" << std::endl;
+        auto links = lex_tokens(input)
+                   | std::views::filter([](const Token& token) { return token.getType() == LINK; })
+                   | std::views::take(2);
+        std::vector<std::string> urls;
+        for (const Token& token : links) {
+            urls.emplace_back(token.getUrl());
+        }
+        bool passed = urls == std::vector<std::string>{"u1", "u2"};
+        std::cout << (passed ? "Test passed!" : "Test failed!") << std::endl;
+    }
+
+    {
+        std::cout << "\nRunning test: Early Stop Test" << std::endl;
+        Lexer lexer(input);
+        std::vector<std::string> urls;
+        for (const Token& token : lex_tokens(lexer)) {
+            if (token.getType() == LINK) {
+                urls.emplace_back(token.getUrl());
+                if (urls.size() == 2) {
+                    break;
+                }
             }
         }
+        // Lexing stopped at the second link, so the lexer resumes right after it
+        Token next = lexer.get_next_token();
+        bool passed = urls == std::vector<std::string>{"u1", "u2"} && next.getType() == TEXT && next.getValue() == ".";
+        if (!passed) {
+            std::cout << "Got " << urls.size() << " urls, then (" << tokenTypeToString(next.getType()) << ", \""
+                      << next.getValue() << "\")" << std::endl;
+        }
+        std::cout << (passed ? "Test passed!" : "Test failed!") << std::endl;
+    }
 
-        if (passed) {
-            std::cout << "Test passed!" << std::endl;
+    {
+        std::cout << "\nRunning test: Empty Input Generator Test" << std::endl;
+        auto tokens = lex_tokens("");
+        bool passed = tokens.begin() == tokens.end();
+        std::cout << (passed ? "Test passed!" : "Test failed!") << std::endl;
+    }
+
+    std::cout << "\nAll generator tests completed!" << std::endl;
+}
+
+void runOutlineTests() {
+    const std::string input =
+        "# Intro\n\nText\n\n## Set Up & Run\n\n```\n# not a heading\n```\n\n## Set up & run\n\n"
+        "#tag\n\n### Deep\n\n# \"?!\"\n";
+
+    ParserOptions options;
+    options.outline = true;
+
+    {
+        std::cout << "\nRunning test: Outline Test" << std::endl;
+        Parser parser(options);
+        std::string html = parser.parse(input);
+        struct Expected {
+            int level;
+            std::string_view text;
+            size_t offset;
+            std::string_view anchor;
+        };
+        std::vector<Expected> expected = {
+            {1, "Intro", 0, "intro"},
+            {2, "Set Up & Run", 15, "set-up--run"},
+            {2, "Set up & run", 57, "set-up--run-1"},
+            {3, "Deep", 80, "deep"},
+            {1, "\"?!\"", 90, "section"},
+        };
+        const std::vector<Heading>& headings = parser.outline().headings();
+        bool passed = headings.size() == expected.size();
+        for (size_t i = 0; passed && i < headings.size(); i++) {
+            passed = headings[i].level == expected[i].level && headings[i].text == expected[i].text &&
+                     headings[i].offset == expected[i].offset && headings[i].anchor == expected[i].anchor &&
+                     input.compare(headings[i].offset, 1, "#") == 0;
+        }
+        passed = passed && html.find("<h2 id=\"set-up--run-1\">Set up &amp; run</h2>") != std::string::npos &&
+                 html.find("<h1 id=\"section\">&quot;?!&quot;</h1>") != std::string::npos;
+        if (!passed) {
+            for (const Heading& heading : headings) {
+                std::cout << "  (" << heading.level << ", \"" << heading.text << "\", " << heading.offset << ", \""
+                          << heading.anchor << "\")" << std::endl;
+            }
+            std::cout << html;
+        }
+        std::cout << (passed ? "Test passed!" : "Test failed!") << std::endl;
+    }
+
+    {
+        std::cout << "\nRunning test: Outline Paths Test" << std::endl;
+        Parser serial(options);
+        std::string expected = serial.parse(input);
+
+        ParserOptions fused_options = options;
+        fused_options.fused = true;
+        ParserOptions parallel_options = options;
+        parallel_options.lex_threads = 3;
+        parallel_options.parallel_min_bytes = 0;
+        ParserOptions memo_options = options;
+        memo_options.memoize_blocks = true;
+
+        bool passed = true;
+        for (const ParserOptions& variant : {fused_options, parallel_options, memo_options}) {
+            Parser parser(variant);
+            for (int round = 0; round < 2; round++) {
+                passed = passed && parser.parse(input) == expected &&
+                         parser.outline().size() == serial.outline().size();
+                for (size_t i = 0; passed && i < serial.outline().size(); i++) {
+                    passed = parser.outline()[i].offset == serial.outline()[i].offset &&
+                             parser.outline()[i].anchor == serial.outline()[i].anchor;
+                }
+            }
+        }
+        std::cout << (passed ? "Test passed!" : "Test failed!") << std::endl;
+    }
+
+    {
+        std::cout << "\nRunning test: Toc Test" << std::endl;
+        Parser parser(options);
+        std::string document = "# A\n## B\n### C\n## D & E\n# F\n### G\n## H\n";
+        parser.parse(document);
+        BufferSink sink;
+        writeToc(parser.outline(), sink);
+        std::string expected =
+            "<nav>\n<ul>\n"
+            "<li><a href=\"#a\">A</a>\n<ul>\n"
+            "<li><a href=\"#b\">B</a>\n<ul>\n"
+            "<li><a href=\"#c\">C</a></li>\n</ul>\n</li>\n"
+            "<li><a href=\"#d--e\">D &amp; E</a></li>\n</ul>\n</li>\n"
+            "<li><a href=\"#f\">F</a>\n<ul>\n"
+            "<li><a href=\"#g\">G</a></li>\n"
+            "<li><a href=\"#h\">H</a></li>\n</ul>\n</li>\n"
+            "</ul>\n</nav>\n";
+        std::string toc = sink.take();
+        bool passed = toc == expected;
+        if (!passed) {
+            std::cout << "Expected:\n" << expected << "Actual:\n" << toc;
+        }
+        std::cout << (passed ? "Test passed!" : "Test failed!") << std::endl;
+    }
+
+    {
+        std::cout << "\nRunning test: Outline Off Test" << std::endl;
+        Parser parser;
+        std::string html = parser.parse("# Title\n");
+        BufferSink sink;
+        writeToc(parser.outline(), sink);
+        bool passed = html == "<h1>Title</h1>\n" && parser.outline().size() == 0 && sink.take().empty();
+        std::cout << (passed ? "Test passed!" : "Test failed!") << std::endl;
+    }
+
+    std::cout << "\nAll outline tests completed!" << std::endl;
+}
+
+/********************
+*    BENCHMARKS     *
+*********************/
+
+// Build with -DNOTEDOWN_BENCH=1 to send every heap allocation in the process
+// through a counter, so --bench can report allocations per KB of input. Other
+// builds keep the normal allocator and leave that column empty.
+#ifndef NOTEDOWN_BENCH
+#define NOTEDOWN_BENCH 0
+#endif
+constexpr bool allocations_counted = NOTEDOWN_BENCH;
+
+static std::atomic<size_t> allocation_count{0};
+
+#if NOTEDOWN_BENCH
+// Kept out of line so the compiler does not pair the inlined free() with
+// operator new and warn about a mismatch
+__attribute__((noinline)) void* operator new(std::size_t size) {
+    allocation_count.fetch_add(1, std::memory_order_relaxed);
+    if (void* p = std::malloc(size == 0 ? 1 : size)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+__attribute__((noinline)) void operator delete(void* p) noexcept {
+    std::free(p);
+}
+
+__attribute__((noinline)) void operator delete(void* p, std::size_t) noexcept {
+    std::free(p);
+}
+#endif
+
+// Small deterministic generator so every run benchmarks the same corpora
+struct BenchRandom {
+    uint64_t state;
+
+    size_t next(size_t bound) {
+        state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+        return static_cast<size_t>(state >> 33) % bound;
+    }
+};
+
+std::string makeCorpus(const std::string& kind, size_t target_size) {
+    static const char* words[] = {
+        "markdown", "parser", "the", "quick", "brown", "fox", "renders", "into",
+        "html", "with", "a", "lexer", "that", "borrows", "its", "input", "and",
+        "emits", "tokens", "for", "every", "heading", "list", "link", "image",
+    };
+    const size_t word_count = sizeof(words) / sizeof(words[0]);
+    BenchRandom rng{42};
+    std::string out;
+    out.reserve(target_size + 256);
+
+    auto sentence = [&](size_t length) {
+        for (size_t i = 0; i < length; i++) {
+            out += words[rng.next(word_count)];
+            out += ' ';
+        }
+    };
+
+    while (out.size() < target_size) {
+        if (kind == "prose") {
+            sentence(60 + rng.next(60));
+            out += "\n\n";
+        } else if (kind == "lists") {
+            out += "## Section\n";
+            for (size_t i = 0, n = 5 + rng.next(10); i < n; i++) {
+                out += "- ";
+                sentence(3 + rng.next(5));
+                out += '\n';
+            }
+            out += '\n';
+        } else if (kind == "links") {
+            for (size_t i = 0; i < 8; i++) {
+                sentence(2 + rng.next(6));
+                out += rng.next(4) == 0 ? "![" : "[";
+                sentence(1 + rng.next(3));
+                out += "](https://example.com/";
+                out += words[rng.next(word_count)];
+                out += ") ";
+            }
+            out += "\n\n";
+        } else if (kind == "emphasis") {
+            for (size_t i = 0; i < 8; i++) {
+                sentence(1 + rng.next(4));
+                const char* marker = rng.next(2) == 0 ? "*" : "**";
+                out += marker;
+                sentence(1 + rng.next(3));
+                out.pop_back();     // close the span right after its last word
+                out += marker;
+                out += ' ';
+            }
+            out += "\n\n";
+        } else if (kind == "code") {
+            sentence(10 + rng.next(20));
+            out += "\n```cpp\n";
+            for (size_t i = 0, n = 10 + rng.next(40); i < n; i++) {
+                out += std::string(rng.next(4) * 4, ' ');
+                out += rng.next(8) == 0 ? "\n" : "if (a < b && *p != '-') { v[i] = \"# [x](y)\"; }\n";
+            }
+            out += "```\n\n";
         } else {
-            std::cout << "Test failed!" << std::endl;
-            std::cout << "Expected tokens:\n";
-            for (const auto& expected : test.expected) {
-                std::cout << "  (" << tokenTypeToString(expected.first) << ", \"" << expected.second << "\")\n";
+            // Unclosed openers, long marker runs and escapes on long lines
+            out += std::string(1 + rng.next(200), '[');
+            out += std::string(1 + rng.next(200), '*');
+            out += std::string(1 + rng.next(20), '#');
+            out += " \\[<&\"> ";
+            sentence(1 + rng.next(10));
+            out += rng.next(8) == 0 ? "\n\n" : "\n";
+        }
+    }
+    return out;
+}
+
+void runBenchmarks() {
+    using Clock = std::chrono::steady_clock;
+    const size_t corpus_size = 4 * 1024 * 1024;
+    const int rounds = 5;
+
+    std::cout << std::left << std::setw(14) << "corpus"
+              << std::right << std::setw(10) << "KB"
+              << std::setw(12) << "tokens"
+              << std::setw(12) << "lex MB/s"
+              << std::setw(12) << "ns/token"
+              << std::setw(12) << "parse MB/s"
+              << std::setw(12) << "fused MB/s"
+              << std::setw(12) << "edit MB/s"
+              << std::setw(12) << "allocs/KB" << std::endl;
+
+    for (const std::string kind : {"prose", "lists", "links", "emphasis", "code", "pathological"}) {
+        std::string corpus = makeCorpus(kind, corpus_size);
+        double megabytes = corpus.size() / (1024.0 * 1024.0);
+
+        // Best of several rounds, so one-off noise does not count as a regression
+        auto best_seconds = [&](const std::function<void()>& body) {
+            double best = 1e30;
+            for (int round = 0; round < rounds; round++) {
+                auto start = Clock::now();
+                body();
+                best = std::min(best, std::chrono::duration<double>(Clock::now() - start).count());
             }
-            std::cout << "Actual tokens:\n";
-            for (const auto& actual : tokens) {
-                std::cout << "  (" << tokenTypeToString(actual.getType()) << ", \"" << actual.getValue() << "\")\n";
+            return best;
+        };
+
+        size_t token_count = 0;
+        Arena arena;
+        double lex_seconds = best_seconds([&]() {
+            arena.reset();
+            Lexer lexer(corpus, &arena);
+            token_count = 0;
+            while (!lexer.get_next_token().isEOF()) {
+                token_count++;
             }
+        });
+
+        Parser parser;
+        std::string html;
+        double parse_seconds = best_seconds([&]() { html = parser.parse(corpus); });
+
+        ParserOptions fused_options;
+        fused_options.fused = true;
+        Parser fused_parser(fused_options);
+        double fused_seconds = best_seconds([&]() { html = fused_parser.parse(corpus); });
+
+        // Re-parse after a one-byte edit, so all but one block come from the memo
+        ParserOptions memo_options;
+        memo_options.memoize_blocks = true;
+        Parser memo_parser(memo_options);
+        std::string edited = corpus;
+        html = memo_parser.parse(edited);
+        double edit_seconds = best_seconds([&]() {
+            edited[edited.size() / 2] ^= 1;
+            html = memo_parser.parse(edited);
+        });
+
+        // The parsers are warm now, so this counts the steady-state allocations
+        size_t allocations_before = allocation_count.load();
+        html = parser.parse(corpus);
+        size_t allocations = allocation_count.load() - allocations_before;
+
+        std::cout << std::left << std::setw(14) << kind
+                  << std::right << std::fixed << std::setprecision(1)
+                  << std::setw(10) << corpus.size() / 1024.0
+                  << std::setw(12) << token_count
+                  << std::setw(12) << megabytes / lex_seconds
+                  << std::setw(12) << lex_seconds * 1e9 / std::max<size_t>(token_count, 1)
+                  << std::setw(12) << megabytes / parse_seconds
+                  << std::setw(12) << megabytes / fused_seconds
+                  << std::setw(12) << megabytes / edit_seconds
+                  << std::setprecision(3) << std::setw(12);
+        if constexpr (allocations_counted) {
+            std::cout << allocations / (corpus.size() / 1024.0) << std::endl;
+        } else {
+            std::cout << "-" << std::endl;
         }
     }
+}
 
-    std::cout << "\nAll tests completed successfully!" << std::endl;
+/********************
+*        CLI        *
+*********************/
+
+struct ConvertJob {
+    std::filesystem::path input;
+    std::filesystem::path output;
+};
+
+bool isMarkdownFile(const std::filesystem::path& path) {
+    std::string extension = path.extension().string();
+    return extension == ".md" || extension == ".markdown";
 }
 
-void runParserTests() {
-    struct TestCase {
-        std::string name;
-        std::string input;
-        std::string expected_html;
+// Expands files and directory trees into jobs. With an output directory the
+// layout below each directory argument is mirrored there; otherwise the HTML is
+// written next to its source. Fails before anything is converted when an output
+// would replace its input or another job's output.
+bool collectJobs(const std::vector<std::string>& inputs, const std::string& output_dir,
+                 const std::string& output_extension, std::vector<ConvertJob>& jobs) {
+    namespace fs = std::filesystem;
+    auto target = [&](const fs::path& file, const fs::path& relative) {
+        fs::path output = output_dir.empty() ? file : fs::path(output_dir) / relative;
+        return output.replace_extension(output_extension);
     };
 
-    std::vector<TestCase> tests = {
-        {
-            "Basic Header Test",
-            "# Header 1",
-            "<h1>Header 1</h1>\n"
-        },
-        {
-            "Multiple Headers Test",
-            "## Header 2\n### Header 3",
-            "<h2>Header 2</h2>\n<h3>Header 3</h3>\n"
-        },
-        {
-            "Text and Bold Test",
-            "This is **bold** text.",
-            "<p>This is <strong>bold</strong> text.</p>\n"
-        },
-        {
-            "Italic Text Test",
-            "This is *italic* text.",
-            "<p>This is <em>italic</em> text.</p>\n"
-        },
-        {
-            "Link Test",
-            "This is a [link](http://example.com).",
-            "<p>This is a <a href=\"http://example.com\">link</a>.</p>\n"
-        },
-        {
-            "Image Test",
-            "This is an image ![Alt text](image.png).",
-            "<p>This is an image <img src=\"image.png\" alt=\"Alt text\">.</p>\n"
-        },
-        {
-            "List Test",
-            "- Item 1\n- Item 2",
-            "<ul>\n<li>Item 1</li>\n<li>Item 2</li>\n</ul>\n"
-        },
-        {
-            "Complex Mixed Content",
-            "# Title\nSome **bold** and *italic* text with a [link](http://example.com).\n- List item 1\n- List item 2",
-            "<h1>Title</h1>\n<p>Some <strong>bold</strong> and <em>italic</em> text with a <a href=\"http://example.com\">link</a>.</p>\n<ul>\n<li>List item 1</li>\n<li>List item 2</li>\n</ul>\n"
-        },
+    for (const std::string& input : inputs) {
+        std::error_code error;
+        if (fs::is_directory(input, error)) {
+            for (fs::recursive_directory_iterator it(input, error), end; it != end && !error; it.increment(error)) {
+                if (it->is_regular_file(error) && isMarkdownFile(it->path())) {
+                    jobs.push_back({it->path(), target(it->path(), fs::relative(it->path(), input))});
+                }
+            }
+        } else if (fs::is_regular_file(input, error)) {
+            jobs.push_back({input, target(input, fs::path(input).filename())});
+        } else {
+            error = std::make_error_code(std::errc::no_such_file_or_directory);
+        }
+        if (error) {
+            std::cerr << "notedown: " << input << ": " << error.message() << std::endl;
+            return false;
+        }
+    }
+
+    // An output must not replace its own input or another job's output, which
+    // with -j could also be written by two workers at once
+    std::unordered_map<std::string, size_t> outputs;
+    for (size_t i = 0; i < jobs.size(); i++) {
+        std::error_code error;
+        fs::path output = fs::weakly_canonical(jobs[i].output, error);
+        fs::path input = fs::weakly_canonical(jobs[i].input, error);
+        if (error) {
+            std::cerr << "notedown: " << jobs[i].input.string() << ": " << error.message() << std::endl;
+            return false;
+        }
+        if (output == input) {
+            std::cerr << "notedown: " << jobs[i].input.string() << ": output would overwrite the input" << std::endl;
+            return false;
+        }
+        auto [found, fresh] = outputs.try_emplace(output.string(), i);
+        if (!fresh) {
+            std::cerr << "notedown: " << jobs[found->second].input.string() << " and " << jobs[i].input.string()
+                      << " both write " << jobs[i].output.string() << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+// Reads the whole file into `buffer`, reusing its capacity
+bool readFile(const std::filesystem::path& path, std::string& buffer) {
+    std::ifstream in(path, std::ios::binary | std::ios::ate);
+    if (!in) {
+        return false;
+    }
+    std::streamsize size = in.tellg();
+    in.seekg(0);
+    buffer.resize(static_cast<size_t>(size));
+    return static_cast<bool>(in.read(buffer.data(), size));
+}
+
+// Converts every job on `thread_count` workers. Each worker keeps one Parser
+// and one input buffer for all the files it takes, so steady-state conversion
+// does not allocate. Token files (.ndtok) given as input are rendered straight
+// from a memory map; with `emit_tokens` markdown is written as token files
+// instead of HTML. With `toc` each HTML file from markdown starts with a <nav>
+// of its headings; with `blocks` markdown is rendered with nested lists and
+// blockquotes. Returns the number of failed files.
+size_t convertFiles(const std::vector<ConvertJob>& jobs, size_t thread_count, bool emit_tokens, bool toc,
+                    bool blocks, ParseStats& stats) {
+    std::atomic<size_t> next_job{0};
+    std::atomic<size_t> failures{0};
+    std::mutex error_mutex;
+    std::mutex stats_mutex;
+    // Threads that would otherwise sit idle help lex the large files
+    size_t lex_threads = std::max<size_t>(1, thread_count / std::max<size_t>(1, jobs.size()));
+
+    auto fail = [&](const ConvertJob& job, const std::string& message) {
+        std::lock_guard<std::mutex> lock(error_mutex);
+        std::cerr << "notedown: " << job.input.string() << ": " << message << std::endl;
+        failures++;
     };
 
-    Parser parser;
+    auto worker = [&]() {
+        ParserOptions options;
+        options.fused = true;
+        options.lex_threads = lex_threads;
+        options.outline = toc;
+        options.block_tree = blocks;
+        Parser parser(options);
+        std::string markdown;
+        BufferSink page;    // the HTML while its outline is written first
 
-    for (const auto& test : tests) {
-        std::cout << "\nRunning test: " << test.name << std::endl;
-        
-        std::string actual_html = parser.parse(test.input);
-        
-        if (actual_html == test.expected_html) {
-            std::cout << "Test passed!" << std::endl;
+        for (size_t i = next_job++; i < jobs.size(); i = next_job++) {
+            const ConvertJob& job = jobs[i];
+            bool from_tokens = job.input.extension() == ".ndtok";
+            std::optional<MappedFile> mapped;
+            if (from_tokens) {
+                mapped.emplace(job.input.string());
+                if (!mapped->good() || !TokenFileView(mapped->bytes()).good()) {
+                    fail(job, "not a readable token file");
+                    continue;
+                }
+            } else if (!readFile(job.input, markdown)) {
+                fail(job, "cannot read file");
+                continue;
+            }
+
+            std::error_code error;
+            if (std::filesystem::equivalent(job.input, job.output, error)) {
+                fail(job, "output " + job.output.string() + " is the input file");
+                continue;
+            }
+            error.clear();
+            if (job.output.has_parent_path()) {
+                std::filesystem::create_directories(job.output.parent_path(), error);
+            }
+
+            // Written next to the output and renamed over it once complete, so a
+            // process that has the old file mapped keeps its pages and never sees
+            // a partial file
+            std::filesystem::path temporary = job.output;
+            temporary += "." + std::to_string(::getpid()) + "." + std::to_string(i) + ".tmp";
+            int fd = ::open(temporary.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0644);
+            if (fd < 0) {
+                fail(job, "cannot write " + temporary.string() + ": " + std::strerror(errno));
+                continue;
+            }
+            FdSink sink(fd);
+            bool written = true;
+            if (from_tokens) {
+                TokenFileView(mapped->bytes()).render(sink);
+            } else if (emit_tokens) {
+                if (!writeTokenFile(markdown, sink)) {
+                    fail(job, "too large for a token file");
+                    written = false;
+                }
+            } else if (toc) {
+                parser.parse(markdown, page);
+                writeToc(parser.outline(), sink);
+                sink.buffer() += page.str();
+                page.buffer().clear();
+                sink.flush();
+            } else {
+                parser.parse(markdown, sink);
+            }
+            if (written && !sink.good()) {
+                fail(job, "cannot write " + temporary.string() + ": " + std::strerror(sink.lastError()));
+                written = false;
+            }
+            if (::close(fd) != 0 && written) {
+                fail(job, "cannot write " + temporary.string() + ": " + std::strerror(errno));
+                written = false;
+            }
+            if (written && ::rename(temporary.c_str(), job.output.c_str()) != 0) {
+                fail(job, "cannot write " + job.output.string() + ": " + std::strerror(errno));
+                written = false;
+            }
+            if (!written) {
+                ::unlink(temporary.c_str());
+            }
+        }
+
+        std::lock_guard<std::mutex> lock(stats_mutex);
+        stats.merge(parser.stats());
+    };
+
+    thread_count = std::max<size_t>(1, std::min(thread_count, jobs.size()));
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < thread_count; i++) {
+        threads.emplace_back(worker);
+    }
+    worker();
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+    return failures;
+}
+
+// Streams stdin to stdout with constant memory. With `blocks` the whole input
+// is read first, since nesting is decided over the whole document.
+int convertStdin(bool blocks, ParseStats& stats) {
+    FdSink sink(STDOUT_FILENO);
+    StreamParser stream(sink);
+    std::string markdown;
+    std::vector<char> chunk(64 * 1024);
+    while (true) {
+        ssize_t count = ::read(STDIN_FILENO, chunk.data(), chunk.size());
+        if (count < 0 && errno == EINTR) {
+            continue;
+        }
+        if (count <= 0) {
+            break;
+        }
+        if (blocks) {
+            markdown.append(chunk.data(), static_cast<size_t>(count));
         } else {
-            std::cout << "Test failed!" << std::endl;
-            std::cout << "Expected:\n" << test.expected_html << std::endl;
-            std::cout << "Got:\n" << actual_html << std::endl;
+            stream.feed(std::string_view(chunk.data(), static_cast<size_t>(count)));
         }
     }
+    if (blocks) {
+        ParserOptions options;
+        options.block_tree = true;
+        Parser parser(options);
+        parser.parse(markdown, sink);
+        stats.merge(parser.stats());
+    } else {
+        stream.finish();
+        stats.merge(stream.stats());
+    }
+    return sink.good() ? 0 : 1;
+}
 
-    std::cout << "\nAll parser tests completed!" << std::endl;
+// Writes the counters in the Prometheus text exposition format
+void writePrometheus(const ParseStats& stats, std::ostream& out) {
+    auto describe = [&](const char* name, const char* type, const char* help) {
+        out << "# HELP notedown_" << name << ' ' << help << '\n'
+            << "# TYPE notedown_" << name << ' ' << type << '\n';
+    };
+    describe("parses_total", "counter", "Documents parsed.");
+    out << "notedown_parses_total " << stats.parses << '\n';
+    describe("input_bytes_total", "counter", "Markdown bytes parsed.");
+    out << "notedown_input_bytes_total " << stats.bytes_in << '\n';
+    describe("output_bytes_total", "counter", "HTML bytes written.");
+    out << "notedown_output_bytes_total " << stats.bytes_out << '\n';
+    describe("tokens_total", "counter", "Tokens rendered, by type.");
+    for (size_t i = 0; i < TOKEN_TYPE_COUNT; i++) {
+        out << "notedown_tokens_total{type=\"" << tokenTypeToString(static_cast<TokenType>(i)) << "\"} "
+            << stats.tokens[i] << '\n';
+    }
+    describe("phase_seconds_total", "counter", "Time spent per phase. Escaping is part of rendering.");
+    const std::pair<const char*, uint64_t> phases[] = {
+        {"parse", stats.parse_ns}, {"lex", stats.lex_ns}, {"render", stats.render_ns}, {"escape", stats.escape_ns},
+    };
+    for (const auto& [phase, nanoseconds] : phases) {
+        out << "notedown_phase_seconds_total{phase=\"" << phase << "\"} " << nanoseconds / 1e9 << '\n';
+    }
+    describe("peak_tokens", "gauge", "Largest token vector held by one parse.");
+    out << "notedown_peak_tokens " << stats.peak_tokens << '\n';
+}
+
+void printUsage() {
+    std::cerr << "usage: notedown [-j threads] [-o output-dir] [--tokens] [--toc] [--blocks] [--metrics file]\n"
+                 "                <file|dir|->...\n"
+                 "       notedown --test | --bench\n"
+                 "\n"
+                 "Converts markdown files to HTML. Directories are searched recursively for\n"
+                 ".md and .markdown files. Without -o every .html file is written next to its\n"
+                 "source. '-' converts stdin to stdout.\n"
+                 "\n"
+                 "--tokens writes memory-mappable .ndtok token files instead of HTML. Token\n"
+                 "files given as input are rendered to HTML without lexing.\n"
+                 "\n"
+                 "--toc gives every heading an id and starts each HTML file converted from\n"
+                 "markdown with a <nav> linking to them. Not used for stdin.\n"
+                 "\n"
+                 "--blocks nests lists by indentation and renders > blockquotes. Without it\n"
+                 "lists are flat and '>' is plain text. Reads stdin whole instead of\n"
+                 "streaming it. Cannot be combined with --tokens or --toc.\n"
+                 "\n"
+                 "--metrics writes parse counters in Prometheus text format to the file once\n"
+                 "conversion is done. Needs a build with -DNOTEDOWN_METRICS=1.\n"
+                 "\n"
+                 "--bench counts allocations only in a build with -DNOTEDOWN_BENCH=1.\n";
 }
 
-int main() {
-    // runTests();
-    // runParserTests();
-    return 0;
+int main(int argc, char** argv) {
+    std::vector<std::string> inputs;
+    std::string output_dir;
+    bool emit_tokens = false;
+    bool toc = false;
+    bool blocks = false;
+    std::string metrics_file;
+    size_t thread_count = std::max(1u, std::thread::hardware_concurrency());
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--test") {
+            runTests();
+            runParserTests();
+            runBlockTreeTests();
+            runIncrementalTests();
+            runCacheTests();
+            runMetricsTests();
+            runGeneratorTests();
+            runOutlineTests();
+            return 0;
+        } else if (arg == "--bench") {
+            runBenchmarks();
+            return 0;
+        } else if (arg == "--tokens") {
+            emit_tokens = true;
+        } else if (arg == "--toc") {
+            toc = true;
+        } else if (arg == "--blocks") {
+            blocks = true;
+        } else if ((arg == "-j" || arg == "-o" || arg == "--metrics") && i + 1 < argc) {
+            if (arg == "--metrics") {
+                metrics_file = argv[++i];
+            } else if (arg == "-o") {
+                output_dir = argv[++i];
+            } else {
+                thread_count = std::max(1, std::atoi(argv[++i]));
+            }
+        } else if (arg == "-h" || arg == "--help") {
+            printUsage();
+            return 0;
+        } else if (arg.size() > 1 && arg[0] == '-') {
+            printUsage();
+            return 2;
+        } else {
+            inputs.push_back(arg);
+        }
+    }
+
+    if (inputs.empty()) {
+        printUsage();
+        return 2;
+    }
+    if (blocks && (toc || emit_tokens)) {
+        std::cerr << "notedown: --blocks cannot be combined with " << (toc ? "--toc" : "--tokens") << std::endl;
+        return 2;
+    }
+    if (!metrics_file.empty() && !metrics_enabled) {
+        std::cerr << "notedown: --metrics needs a build with -DNOTEDOWN_METRICS=1" << std::endl;
+        return 2;
+    }
+
+    ParseStats stats;
+    int status;
+    if (inputs.size() == 1 && inputs[0] == "-") {
+        status = convertStdin(blocks, stats);
+    } else {
+        std::vector<ConvertJob> jobs;
+        if (!collectJobs(inputs, output_dir, emit_tokens ? ".ndtok" : ".html", jobs)) {
+            return 1;
+        }
+        status = convertFiles(jobs, thread_count, emit_tokens, toc, blocks, stats) == 0 ? 0 : 1;
+    }
+
+    if (!metrics_file.empty()) {
+        std::ofstream out(metrics_file);
+        writePrometheus(stats, out);
+        if (!out) {
+            std::cerr << "notedown: cannot write " << metrics_file << std::endl;
+            return 1;
+        }
+    }
+    return status;
 }
\ No newline at end of file